@@ -0,0 +1,125 @@
+// microbenchmarks of the shell's hot paths, built against mysh.c without its main
+// output is one "name<tab>value<tab>unit" line per measurement
+#define MYSH_NO_MAIN
+#include "../mysh.c"
+
+#define FILES 10000
+
+long long now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void report(const char* name, long long ns, long iterations){
+    printf("%s\t%.1f\tns/op\n", name, (double) ns / iterations);
+}
+
+void bench_tokens(void){
+    char line[] = "grep -v foo < input.txt | sort -u | head -n 10 > out.txt && echo done; ls *.c &";
+    long iterations = 1000000;
+    long long start = now_ns();
+    for(long i = 0; i < iterations; i++){
+        make_tokens(line, sizeof(line) - 1);
+        arena_reset(&line_arena);
+    }
+    report("make_tokens", now_ns() - start, iterations);
+}
+
+void bench_wildcard(void){
+    char* cases[][3] = {
+        {"check_wildcard_star", "build-2024-03-17.log", "*.log"},
+        {"check_wildcard_infix", "build-2024-03-17.log", "build-*-17.*"},
+        {"check_wildcard_set", "build-2024-03-17.log", "b?ild-[0-9]*[a-m]og"},
+        {"check_wildcard_miss", "build-2024-03-17.log", "*.txt"},
+    };
+    long iterations = 1000000;
+    for(int c = 0; c < (int) (sizeof(cases) / sizeof(cases[0])); c++){
+        long matched = 0;
+        long long start = now_ns();
+        for(long i = 0; i < iterations; i++){
+            matched += check_wildcard(cases[c][1], cases[c][2]);
+            // the compiled pattern lives in the arena, as it would for one line
+            arena_reset(&line_arena);
+        }
+        report(cases[c][0], now_ns() - start, iterations);
+        if(matched != 0 && matched != iterations){
+            fprintf(stderr, "%s: inconsistent result\n", cases[c][0]);
+        }
+    }
+}
+
+void bench_executable(void){
+    char* names[] = {"true", "ls", "sh"};
+    long iterations = 1000000;
+    long long start = now_ns();
+    exec_cache_clear();
+    find_executable(names[0]);
+    report("find_executable_cold", now_ns() - start, 1);
+    start = now_ns();
+    for(long i = 0; i < iterations; i++){
+        find_executable(names[i % 3]);
+        if(i % 1024 == 0){
+            arena_reset(&line_arena);
+        }
+    }
+    report("find_executable_cached", now_ns() - start, iterations);
+    arena_reset(&line_arena);
+}
+
+process* empty_process(void){
+    process* proc = arena_alloc(&line_arena, sizeof(process));
+    memset(proc, 0, sizeof(process));
+    proc->type = bare;
+    proc->globStart = -1;
+    proc->globEnd = -1;
+    return proc;
+}
+
+// globs over a synthetic directory of FILES names, half of them matching
+void bench_glob(void){
+    char dir[] = "/tmp/mysh-bench-XXXXXX";
+    char name[64];
+    if(mkdtemp(dir) == NULL || chdir(dir) == -1){
+        perror(dir);
+        return;
+    }
+    for(int i = 0; i < FILES; i++){
+        snprintf(name, sizeof(name), "file%05d.%s", i, i % 2 ? "log" : "txt");
+        close(open(name, O_CREAT|O_WRONLY|O_CLOEXEC, 0644));
+    }
+    long long start = now_ns();
+    process* proc = empty_process();
+    find_wildcards(proc, "*.log", NULL);
+    report("find_wildcards_10k_cold", now_ns() - start, 1);
+    arena_reset(&line_arena);
+    long iterations = 100;
+    start = now_ns();
+    for(long i = 0; i < iterations; i++){
+        proc = empty_process();
+        find_wildcards(proc, "*.log", NULL);
+        arena_reset(&line_arena);
+    }
+    report("find_wildcards_10k", now_ns() - start, iterations);
+    start = now_ns();
+    for(long i = 0; i < iterations; i++){
+        proc = empty_process();
+        find_wildcards(proc, "file0[0-4]*9.?og", NULL);
+        arena_reset(&line_arena);
+    }
+    report("find_wildcards_10k_set", now_ns() - start, iterations);
+    for(int i = 0; i < FILES; i++){
+        snprintf(name, sizeof(name), "file%05d.%s", i, i % 2 ? "log" : "txt");
+        unlink(name);
+    }
+    chdir("/");
+    rmdir(dir);
+}
+
+int main(void){
+    bench_tokens();
+    bench_wildcard();
+    bench_executable();
+    bench_glob();
+    return 0;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# end to end scenarios run through a mysh binary
+# usage: bench/e2e.sh [mysh binary]
+MYSH=${1:-./mysh}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now() {
+    date +%s%N
+}
+
+# a batch script of 10k commands that do nothing
+seq 10000 | sed 's|.*|/bin/true|' > "$WORK/true.sh"
+start=$(now)
+"$MYSH" "$WORK/true.sh" || exit 1
+end=$(now)
+echo "script_10k_true	$(((end - start) / 10000))	ns/line"
+
+# 1 GiB through an eight stage pipeline
+echo "head -c 1073741824 /dev/zero | cat | cat | cat | cat | cat | cat | wc -c > $WORK/count" > "$WORK/pipe.sh"
+start=$(now)
+"$MYSH" "$WORK/pipe.sh" || exit 1
+end=$(now)
+[ "$(cat "$WORK/count")" = 1073741824 ] || { echo "pipeline moved $(cat "$WORK/count") bytes" >&2; exit 1; }
+echo "pipeline_1gib_8_stages	$((1024 * 1000000 / ((end - start) / 1000)))	MiB/s"
+
+# globs over a directory of 100k files
+mkdir "$WORK/files"
+(cd "$WORK/files" && seq -f 'file%06g.dat' 100000 | xargs touch)
+{
+    echo "cd $WORK/files"
+    echo "set -o xargs"
+    seq 20 | sed 's|.*|/bin/true *.dat|'
+} > "$WORK/glob.sh"
+start=$(now)
+"$MYSH" "$WORK/glob.sh" || exit 1
+end=$(now)
+echo "glob_100k_files	$(((end - start) / 20000))	us/glob"
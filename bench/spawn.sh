@@ -0,0 +1,22 @@
+#!/bin/sh
+# compares launch latency of posix_spawn against fork/exec
+# usage: bench/spawn.sh [mysh binary] [lines]
+MYSH=${1:-./mysh}
+LINES=${2:-10000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+i=0
+while [ $i -lt "$LINES" ]; do
+    echo /bin/true
+    i=$((i + 1))
+done > "$SCRIPT"
+
+for launcher in spawn fork; do
+    start=$(date +%s%N)
+    stats=$(MYSH_STATS=1 MYSH_LAUNCH=$launcher "$MYSH" "$SCRIPT" 2>&1 >/dev/null) || exit 1
+    end=$(date +%s%N)
+    total=$((end - start))
+    echo "spawn_latency_$launcher	$((total / LINES))	ns/command	($LINES commands, $((total / 1000000)) ms)"
+    echo "$stats" | sed -n 's/^mysh: \([0-9]*\) lines, \([0-9]*\) arena allocations, \([0-9]*\) mallocs.*/allocations_'$launcher'	\2	arena allocations\nmallocs_'$launcher'	\3	mallocs/p'
+done
@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// runs a script on a mysh --serve daemon and exits with its status
+// mysh-client socket file     runs the file with our stdin
+// mysh-client socket -c line  runs one line
+// mysh-client socket          runs what is on stdin, which the script then can't read
+
+#define SERVE_FDS 4
+
+void usage(void){
+    fputs("usage: mysh-client socket [file | -c line]\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+// the whole script, read into memory
+char* read_script(int fd, uint32_t* len){
+    size_t cap = 4096, used = 0;
+    char* text = malloc(cap);
+    ssize_t n;
+    while(text != NULL && (n = read(fd, text + used, cap - used)) > 0){
+        used += n;
+        if(used == cap){
+            cap *= 2;
+            text = realloc(text, cap);
+        }
+    }
+    if(text == NULL){
+        perror("script");
+        exit(EXIT_FAILURE);
+    }
+    *len = used;
+    return text;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2 || argc > 4 || (argc == 4 && strcmp(argv[2], "-c") != 0)){
+        usage();
+    }
+    char* script;
+    char* text = NULL;
+    uint32_t len;
+    int in = STDIN_FILENO;
+    if(argc == 4){
+        len = strlen(argv[3]);
+        script = argv[3];
+    } else if(argc == 3){
+        int fd = open(argv[2], O_RDONLY);
+        if(fd == -1){
+            perror(argv[2]);
+            exit(EXIT_FAILURE);
+        }
+        script = text = read_script(fd, &len);
+        close(fd);
+    } else{
+        script = text = read_script(STDIN_FILENO, &len);
+        in = open("/dev/null", O_RDONLY);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(argv[1]) >= sizeof(addr.sun_path)){
+        fputs("mysh-client: socket path too long\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock == -1 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1){
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    int fds[SERVE_FDS] = {in, STDOUT_FILENO, STDERR_FILENO, open(".", O_RDONLY|O_DIRECTORY)};
+    if(fds[0] == -1 || fds[3] == -1){
+        perror("mysh-client");
+        exit(EXIT_FAILURE);
+    }
+    union{
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if(sendmsg(sock, &msg, 0) != sizeof(len)){
+        perror("send");
+        exit(EXIT_FAILURE);
+    }
+    for(uint32_t done = 0; done < len; ){
+        ssize_t n = write(sock, script + done, len - done);
+        if(n <= 0){
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+    free(text);
+
+    // the daemon's child holds our descriptors, so all that comes back is the status
+    int32_t status;
+    size_t got = 0;
+    ssize_t n;
+    while(got < sizeof(status) && (n = read(sock, (char*) &status + got, sizeof(status) - got)) > 0){
+        got += n;
+    }
+    if(got != sizeof(status)){
+        fputs("mysh-client: the daemon hung up\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    return status;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,7 +10,27 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
-#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <locale.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <stdint.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_SPAWN_TCSETPGRP
+#endif
+#include <spawn.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifndef BUFSIZE
 #define BUFSIZE 1024
@@ -20,7 +41,397 @@ int linePos, lineSize;
 
 typedef enum token_types token_type;
 
-enum token_types{cd, pwd, in, out, comb, path, bare, term};
+enum token_types{cd, pwd, set, hash, jobctl, timed, builtin, assign, loop, body, in, heredoc, herestr, here, out, comb, amp, semi, andif, orif, path, bare, term};
+
+// background and stopped pipelines
+typedef struct job_info job;
+
+struct job_info{
+    int id;
+    pid_t pgid;
+    pid_t* pids;
+    int* results;
+    int stages;
+    int stopped;
+    char* text;
+    job* next;
+};
+
+job* job_list;
+volatile sig_atomic_t child_exited;
+// ^C ends any loop running: either a foreground stage was killed by it, or the
+// shell itself caught it while a loop ran builtins
+volatile sig_atomic_t interrupted;
+int job_control;
+int interactive_shell;
+pid_t shell_pgid;
+sigset_t default_signals;
+sigset_t empty_signals;
+
+// wildcard matches are sorted with strcoll unless the collation locale is plain C
+int collate_c = 1;
+long argLimit;
+
+// set from MYSH_LAUNCH=fork to launch commands with fork/exec instead of posix_spawn
+int use_fork = 0;
+
+// options toggled with the set builtin
+int pipefail = 0;
+int xargs = 0;
+
+struct shell_option{
+    const char* name;
+    int* flag;
+};
+
+struct shell_option options[] = {
+    {"pipefail", &pipefail},
+    {"xargs", &xargs},
+};
+
+#define NUM_OPTIONS (int) (sizeof(options) / sizeof(options[0]))
+
+// shell variables are "NAME=value" strings in a hash table, each made once per
+// assignment and never changed; the exported ones are gathered into an envp that
+// environ points at, rebuilt only when one of them changes
+typedef struct var_info var;
+
+struct var_info{
+    char* entry;
+    int nameLen;
+    int exported;
+    var* next;
+};
+
+#define VAR_BUCKETS 256
+
+var* var_table[VAR_BUCKETS];
+int vars_loaded;
+char** shell_envp;
+int envp_count;
+// what $? expands to
+int last_status;
+
+// everything built while running one line comes out of a bump allocator
+// that is reset when the line is done, instead of being freed piece by piece
+typedef struct arena_chunk_info arena_chunk;
+
+struct arena_chunk_info{
+    arena_chunk* next;
+    size_t size;
+    size_t used;
+    size_t pad; // keeps data on a 16 byte boundary
+    char data[];
+};
+
+typedef struct{
+    arena_chunk* head;
+    arena_chunk* spare; // the largest chunk given back by a rewind, used before mallocing
+    size_t used;
+    long peak;
+    long allocs;
+    long mallocs;
+} arena;
+
+// where the arena stood, so a loop can give back what one time round allocated
+typedef struct{
+    arena_chunk* head;
+    size_t chunkUsed;
+    size_t used;
+} arena_mark;
+
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN 16
+
+arena line_arena;
+long lines_run;
+
+// MYSH_TRACE=json|chrome[:file] times the phases of every line; each line is
+// written out as a record and every phase gets a latency histogram at exit
+#define PHASE_LINE 0
+#define PHASE_TOKENIZE 1
+#define PHASE_TYPE 2
+#define PHASE_PARSE 3
+#define PHASE_LOOKUP 4
+#define PHASE_GLOB 5
+#define PHASE_PIPE 6
+#define PHASE_SPAWN 7
+#define PHASE_WAIT 8
+#define NUM_PHASES 9
+
+const char* phase_names[NUM_PHASES] = {"line", "tokenize", "type", "parse", "lookup", "glob", "pipe", "spawn", "wait"};
+
+#define TRACE_NONE 0
+#define TRACE_JSON 1
+#define TRACE_CHROME 2
+
+// log-linear buckets: values below 16ns exactly, then 16 buckets per power of two
+#define HIST_SUB 16
+#define HIST_BUCKETS (HIST_SUB + 60 * HIST_SUB)
+
+typedef struct{
+    long count;
+    long long min;
+    long long max;
+    long buckets[HIST_BUCKETS];
+} histogram;
+
+int trace_format;
+int trace_fd = -1;
+long long trace_line_start;
+long long trace_ns[NUM_PHASES];
+int trace_calls[NUM_PHASES];
+// shared with -j workers so their lines land in the same histograms
+histogram* trace_hist;
+// chrome events for the current line, written out with it
+FILE* trace_events;
+char* trace_text;
+size_t trace_size;
+
+// byte classes for the tokenizer, anything not listed is part of a word
+#define CH_BLANK 1
+#define CH_SPECIAL 2
+
+unsigned char char_class[256] = {
+    [' '] = CH_BLANK, ['\t'] = CH_BLANK, ['\n'] = CH_BLANK,
+    ['|'] = CH_SPECIAL, ['<'] = CH_SPECIAL, ['>'] = CH_SPECIAL, ['&'] = CH_SPECIAL, [';'] = CH_SPECIAL,
+};
+
+// where lines come from: a mapped script or a descriptor read in chunks
+typedef struct{
+    int fd;
+    char* map;
+    size_t mapLen;
+    size_t mapPos;
+    char buffer[BUFSIZE];
+    int bufPos;
+    int bufLen;
+    int keepLine; // the next line is added to the one in lineBuffer
+    int edit; // a terminal read through the line editor
+    const char* prompt;
+} line_source;
+
+// interactive history is one file with an entry per line; each entry goes in with
+// a single O_APPEND write so sessions sharing the file never interleave, and the
+// file is read through a mapping that grows along with it
+typedef struct{
+    uint32_t key; // the three bytes plus one, 0 marks a free slot
+    uint32_t count;
+    uint32_t cap;
+    uint32_t* ids;
+} trigram_list;
+
+typedef struct{
+    int fd;
+    char* map;
+    size_t mapLen;
+    size_t* starts; // where each entry begins, and one more past the last
+    int count;
+    int cap;
+    // which entries hold each three byte sequence, built when ^R is first used
+    trigram_list* trigrams;
+    int trigramCap;
+    int trigramUsed;
+    int indexed;
+} history;
+
+history hist = {.fd = -1};
+struct termios cooked_termios;
+
+// keys the editor reads as escape sequences
+#define KEY_UP 256
+#define KEY_DOWN 257
+#define KEY_LEFT 258
+#define KEY_RIGHT 259
+#define KEY_HOME 260
+#define KEY_END 261
+#define KEY_DELETE 262
+
+// the line being edited
+typedef struct{
+    char* buf;
+    int len;
+    int cap;
+    int pos;
+    const char* prompt;
+} line_editor;
+
+// command names for Tab: every builtin and every executable on PATH in a prefix
+// trie, built on the first Tab and again once PATH or one of its directories changes
+typedef struct{
+    int child;
+    int sibling;
+    int names; // names ending here or further down
+    unsigned char chr;
+    unsigned char end;
+} trie_node;
+
+typedef struct{
+    trie_node* nodes; // the root is the first
+    int count;
+    int cap;
+    char* path;
+    struct timespec* mtimes;
+    int dirs;
+} command_trie;
+
+command_trie command_names;
+
+// how many candidates Tab lists at most
+#define COMPLETION_LIST 100
+
+// a wildcard pattern compiled once per path component
+#define GLOB_STAR 0
+#define GLOB_CHAR 1
+#define GLOB_ANY 2
+#define GLOB_SET 3
+
+typedef struct{
+    unsigned char kind;
+    unsigned char chr;
+    unsigned char* set;
+} glob_elem;
+
+typedef struct{
+    glob_elem* elems;
+    int count;
+    int minLen;
+    int stars;
+    int dotfiles;
+    char* prefix;
+    int prefixLen;
+    char* suffix;
+    int suffixLen;
+} glob_pattern;
+
+// directory listings shared by every wildcard that reads the same directory
+typedef struct{
+    int offset;
+    int len;
+    unsigned char type;
+} dir_entry;
+
+typedef struct{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int racy;
+    long lastUse;
+    char* names;
+    int namesCap;
+    dir_entry* entries;
+    int count;
+    int entryCap;
+} dir_listing;
+
+#define DIR_CACHE_SIZE 16
+#define DENTS_SIZE (256 * 1024)
+#define DIR_RACY_NS 100000000L
+
+dir_listing dir_cache[DIR_CACHE_SIZE];
+long dir_clock;
+char* dents_buffer;
+
+// MYSH_CACHE_DIR keeps scripts in tokenized form; a file there holds a header, the
+// mtimes of the PATH directories, line and token records, the commands found on
+// the path, and last the strings everything above points into
+// the magic changes whenever the tokenizer or the token types do
+#define CACHE_MAGIC "MYSHC08"
+
+typedef struct{
+    char magic[8];
+    uint64_t size;
+    uint64_t ino;
+    uint64_t dev;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t hash;
+    uint64_t pathHash;
+    uint32_t lines;
+    uint32_t tokens;
+    uint32_t dirs;
+    uint32_t execs;
+    uint32_t stringsLen;
+    uint32_t pad;
+} cache_header;
+
+typedef struct{
+    uint32_t first;
+    uint32_t count;
+    uint32_t textOffset; // where the line is in the script, for tracing
+    uint32_t textLen;
+} cached_line;
+
+typedef struct{
+    uint32_t offset;
+    uint32_t len;
+    uint8_t type;
+    uint8_t wildcard;
+} cached_token;
+
+typedef struct{
+    int64_t sec;
+    int64_t nsec;
+} cached_dir;
+
+typedef struct{
+    uint32_t name;
+    uint32_t path;
+} cached_exec;
+
+typedef struct{
+    char* map;
+    size_t mapLen;
+    cache_header* header;
+    cached_line* lines;
+    cached_token* tokens;
+    cached_dir* dirs;
+    cached_exec* execs;
+    char* strings;
+} script_cache;
+
+// a growing byte array the cache is assembled in before it is written
+typedef struct{
+    char* data;
+    size_t len;
+    size_t cap;
+} byte_buffer;
+
+// descriptors a --serve client sends: stdin, stdout, stderr and its working directory
+#define SERVE_FDS 4
+#define SERVE_TIMEOUT 5
+#define SERVE_PENDING 64
+
+// a connection whose request hasn't all arrived yet; requests are read a piece at
+// a time as they come, so a slow client holds up nobody but itself
+typedef struct{
+    int conn;
+    int fds[SERVE_FDS];
+    int script; // -1 until the length and descriptors have come
+    uint32_t left;
+    time_t deadline; // by when the whole request must be in
+} serve_request;
+
+// what time reports for each stage of a pipeline
+#define TIME_NONE 0
+#define TIME_HUMAN 1
+#define TIME_POSIX 2
+#define TIME_JSON 3
+
+typedef struct{
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+} stage_time;
+
+// a line of a -j run, with the output it is holding back
+typedef struct{
+    pid_t pid;
+    int out;
+    int err;
+    int done;
+    int status;
+} batch_slot;
 
 typedef struct token_info token;
 typedef struct process_info process;
@@ -39,43 +450,346 @@ struct process_info{
     char* path_name;
     char** arguments;
     int argCount;
+    int argCap;
+    int globStart;
+    int globEnd;
+    int globGap; // fixed words sit between two expansions, so the span can't be split
+    token* source;
     char* input;
+    char* here; // a here-document or here-string that becomes the input
+    int hereLen;
     char* output;
+    char** env; // NAME=value words in front of the command
+    int envCount;
     process* next;
     process* prev;
 };
 
-void free_tokens(token*);
-void free_command(process*);
-void free_commands(process*);
+// every builtin, in a table indexed by a perfect hash of its name so set_type
+// needs one compare per word; the hash was picked by hand for exactly these names
+// a builtin that streams only runs in the shell as the first or last stage, and one
+// that moves data not at all under job control, where it couldn't be interrupted
+// one that accepts only some arguments leaves the rest to the program of that name
+typedef struct{
+    const char* name;
+    int len;
+    token_type type;
+    int (*run)(process*, int, int);
+    int streams;
+    int (*accepts)(process*);
+} builtin_info;
+
+#define BUILTIN_STREAMS 1
+#define BUILTIN_DATA 2
+
+#define BUILTIN_SLOTS 32
+
+// how move_data gets bytes from one descriptor to another
+#define MOVE_COPY_RANGE 0
+#define MOVE_SPLICE 1
+#define MOVE_SENDFILE 2
+#define MOVE_RW 3
+#define MOVE_CHUNK 65536
+
+// the $(...) in the pipeline being expanded, all started before any is read and
+// found again by where they sit in the line
+typedef struct{
+    const char* start;
+    pid_t pid;
+    int fd;
+    char* output;
+    int outputLen;
+} substitution;
+
+substitution* substitutions;
+int num_substitutions;
+
+// a line is a list of pipelines and loops joined by ;, &, && or ||
+typedef struct list_info list;
+typedef struct loop_info shell_loop;
+
+struct list_info{
+    token* pipeline;
+    shell_loop* loop; // set instead of running the pipeline
+    token_type connector;
+    list* next;
+};
+
+// for name in words; do body; done runs the body once per word, and
+// while condition; do body; done as long as the condition succeeds
+struct loop_info{
+    token* name; // NULL for while
+    token* words;
+    list* condition;
+    list* body;
+};
+
+int run_line(char*, int, int);
+int run_tokens(token*, char*, int, int);
+uint64_t hash_bytes(const char*, size_t, uint64_t);
+char* cache_file_name(const char*, const char*);
+int open_script_cache(script_cache*, line_source*, const char*, const char*);
+int load_script_cache(script_cache*, int, struct stat*, uint64_t);
+int compile_script(line_source*, int, const char*, struct stat*, uint64_t);
+size_t buffer_add(byte_buffer*, const void*, size_t);
+token* cached_tokens(script_cache*, cached_line*);
+int run_cached(script_cache*, line_source*);
+void seed_exec_cache(script_cache*);
+int serve(const char*);
+int serve_socket(const char*);
+int receive_request(serve_request*);
+void warm_exec_cache(line_source*, int, int);
+void serve_client(int, int*, line_source*);
+list* parse_list(token*);
+list* parse_commands(token**, int);
+shell_loop* parse_loop(token**);
+int is_separator(token*);
+int command_follows(token*, int);
+int run_list(list*, int);
+int run_loop(shell_loop*, int);
+int loop_rounds(shell_loop*, int);
+void interrupt_handler(int);
+void catch_interrupt(struct sigaction*);
+void print_stats(void);
+void init_trace(const char*);
+long long trace_start(void);
+void trace_end(int, long long);
+void trace_line(const char*, int);
+void trace_reset(void);
+void print_trace(void);
+long long bucket_value(int);
+long long percentile(histogram*, double);
+void* arena_alloc(arena*, size_t);
+char* arena_strndup(arena*, const char*, int);
+void arena_reset(arena*);
+void arena_get_mark(arena*, arena_mark*);
+void arena_rewind(arena*, arena_mark*);
+void add_argument(process*, char*);
 process* process_tokens(token*);
 void append(char *, int);
-token* make_tokens(void);
-int execute_processes(process*);
+void open_source(line_source*, int);
+void close_source(line_source*);
+int next_line(line_source*, char**, int*);
+int next_unit(line_source*, char**, int*);
+int unit_line(line_source*, char**, int*, char**, int*);
+void read_bodies(line_source*, char**, int*, int);
+int loop_depth(const char*, int);
+int heredoc_delimiter(const char*, int, int*);
+void history_open(void);
+void history_sync(void);
+int history_truncated(void);
+void history_reset(void);
+char* history_entry(int, int*);
+void history_add(const char*, int);
+void history_index(void);
+trigram_list* trigram_slot(uint32_t);
+void trigram_add(uint32_t, uint32_t);
+int history_search(const char*, int, int);
+int edit_line(line_source*, char**, int*);
+int read_byte(void);
+int read_key(void);
+void editor_refresh(line_editor*);
+void editor_set(line_editor*, const char*, int);
+void editor_insert(line_editor*, const char*, int);
+void editor_delete(line_editor*, int, int);
+int editor_search(line_editor*);
+int match_position(int, const char*, int);
+void trie_insert(const char*, int);
+int command_trie_stale(void);
+void build_command_trie(void);
+void trie_names(int, byte_buffer*, byte_buffer*, int*);
+int file_candidates(const char*, int, byte_buffer*);
+void show_candidates(byte_buffer*, int, int);
+void complete_line(line_editor*);
+int here_input(process*);
+int line_needs_shell(token*);
+void run_parallel(line_source*, int);
+int start_worker(batch_slot*, token*, char*, int, int);
+void wait_worker(batch_slot*, int, int, int);
+void flush_workers(batch_slot*, int*, int*, int);
+void copy_fd(int, int);
+token* make_tokens(char*, int);
+int word_end(const char*, int, int);
+int token_is(token*, const char*);
+char* token_string(token*);
+int execute_processes(process*, int, int);
+int wait_timed(pid_t*, int*, int, int, stage_time*);
+void rusage_since(struct rusage*, struct rusage*);
+double elapsed(struct timespec*, struct timespec*);
+double seconds(struct timeval*);
+void json_string(FILE*, const char*);
+void report_timing(process*, stage_time*, int*, int, int);
+int pipeline_status(int*, int);
+int wait_stages(pid_t*, int*, int, int, int*);
+void child_handler(int);
+void init_job_control(int);
+char* tokens_text(token*);
+job* add_job(process*, pid_t*, int*, int, pid_t);
+void remove_job(job*);
+int job_done(job*);
+void reap_jobs(int);
+job* find_job(char*);
+void continue_job(job*);
+int foreground_job(job*);
+int wait_job(job*);
+int run_job_builtin(process*, int, int);
+void reset_signals(void);
+int run_cd(process*);
+int run_pwd(process*, int, int);
+int run_set(process*, int, int);
+int run_export(process*, int, int);
+int run_unset(process*, int, int);
+int var_name_length(const char*, int);
+unsigned int var_hash(const char*, int);
+void load_variables(void);
+var* find_var(const char*, int);
+char* var_value(const char*, int);
+void set_var(const char*, int);
+void unset_var(const char*);
+void rebuild_envp(void);
+char** process_envp(process*);
+char* expand_word(token*);
+char* expand_text(token*, char**, int*);
+void expand_add(byte_buffer*, byte_buffer*, const char*, size_t, int);
+int substitution_end(const char*, int, int);
+int word_span(const char*, int, int);
+int attach_bodies(token*, char*, int, int);
+token_type keyword_type(token*);
+void run_substitutions(token*);
+pid_t start_substitution(const char*, int, int*);
+void read_substitutions(substitution*, int);
+substitution* find_substitution(const char*, int);
+void add_words(process*, token*);
+int builtin_output(process*, int);
+unsigned int builtin_hash(const char*, int);
+builtin_info* find_builtin(const char*, int);
+int write_all(int, const char*, size_t);
+int run_echo(process*, int, int);
+int run_true(process*, int, int);
+int run_false(process*, int, int);
+int run_test(process*, int, int);
+int test_unary(const char*, const char*);
+int test_binary(const char*, const char*, const char*);
+int test_number(const char*, long long*);
+int run_printf(process*, int, int);
+int move_data(int, int);
+int plain_arguments(process*);
+int cp_arguments(process*);
+int run_cat(process*, int, int);
+int run_tee(process*, int, int);
+int run_cp(process*, int, int);
+int builtin_in_shell(process*, builtin_info*, int, int);
+void printf_escape(FILE*, const char**);
+pid_t launch_process(process*, int, int, pid_t*, int);
+long arg_limit(void);
+long argument_bytes(process*, int, int);
+pid_t launch_split(process*, int, int, pid_t*, int);
 char* find_executable(char*);
+void exec_cache_sync(void);
+void exec_cache_clear(void);
+void exec_cache_forget(char*);
+int run_hash(process*, int, int);
 int check_executables(process*);
-void find_wildcards(process*, char *, int);
+void find_wildcards(process*, char *, const char*);
+int compare_bytes(const void*, const void*);
+int compare_collate(const void*, const void*);
+int has_wildcard(const char*, const char*, int);
+int word_has_wildcard(const char*, int);
+void expand_components(process*, char*, int, char*, glob_pattern**, int*);
+glob_pattern* compile_glob(const char*, const char*, int);
+dir_listing* list_directory(char*);
+int read_directory(dir_listing*, char*);
+int read_directory_fd(dir_listing*, int);
+int glob_segment(glob_elem*, int, const char*);
+int glob_match(glob_pattern*, const char*, int);
 int check_wildcard(char*, char*);
 
+builtin_info builtin_table[BUILTIN_SLOTS] = {
+    [0] = {"bg", 2, jobctl, run_job_builtin, 0, NULL},
+    [1] = {"[", 1, builtin, run_test, 0, NULL},
+    [3] = {"exit", 4, term, NULL, 0, NULL},
+    [4] = {"false", 5, builtin, run_false, 0, NULL},
+    [5] = {"echo", 4, builtin, run_echo, BUILTIN_STREAMS, NULL},
+    [6] = {"pwd", 3, pwd, run_pwd, 0, NULL},
+    [7] = {"cat", 3, builtin, run_cat, BUILTIN_DATA, plain_arguments},
+    [8] = {"true", 4, builtin, run_true, 0, NULL},
+    [11] = {"export", 6, set, run_export, 0, NULL},
+    [14] = {"hash", 4, hash, run_hash, 0, NULL},
+    [15] = {"set", 3, set, run_set, 0, NULL},
+    [16] = {"jobs", 4, jobctl, run_job_builtin, 0, NULL},
+    [18] = {"time", 4, timed, NULL, 0, NULL},
+    [20] = {"printf", 6, builtin, run_printf, BUILTIN_STREAMS, NULL},
+    [21] = {"cd", 2, cd, NULL, 0, NULL},
+    [22] = {"tee", 3, builtin, run_tee, BUILTIN_DATA, plain_arguments},
+    [23] = {"wait", 4, jobctl, run_job_builtin, 0, NULL},
+    [26] = {"test", 4, builtin, run_test, 0, NULL},
+    [27] = {"unset", 5, set, run_unset, 0, NULL},
+    [28] = {"fg", 2, jobctl, run_job_builtin, 0, NULL},
+    [29] = {"cp", 2, builtin, run_cp, BUILTIN_DATA, cp_arguments},
+};
+
+// bench/bench.c includes this file and brings its own main
+#ifndef MYSH_NO_MAIN
 int main(int argc, char **argv){
-    int fin, bytes, pos, lstart, status;
-    char buffer[BUFSIZE];
+    int fin, status;
+    line_source source;
+    char* line;
+    int len;
+    int max_jobs = 0;
+    int arg = 1;
+
+    // -j N runs the lines of a batch script N at a time
+    if(argc > arg && strncmp(argv[arg], "-j", 2) == 0){
+        char* count = argv[arg][2] != '\0' ? argv[arg] + 2 : argc > arg + 1 ? argv[++arg] : "";
+        max_jobs = atoi(count);
+        if(max_jobs < 1){
+            fputs("usage: mysh [-j jobs] [file]\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        arg++;
+    }
+
+    if(getenv("MYSH_STATS") != NULL){
+        atexit(print_stats);
+    }
+    if(getenv("MYSH_TRACE") != NULL){
+        init_trace(getenv("MYSH_TRACE"));
+    }
+    char* collate = setlocale(LC_COLLATE, "");
+    collate_c = collate == NULL || strcmp(collate, "C") == 0 || strcmp(collate, "POSIX") == 0;
+    char* launcher = getenv("MYSH_LAUNCH");
+    if(launcher != NULL && strcmp(launcher, "fork") == 0){
+        use_fork = 1;
+    }
+
+    if(argc > arg && strcmp(argv[arg], "--serve") == 0){
+        if(argc != arg + 2){
+            fputs("usage: mysh --serve socket\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        init_job_control(0);
+        lineBuffer = (char *) malloc(BUFSIZE);
+        lineSize = BUFSIZE;
+        linePos = 0;
+        return serve(argv[arg + 1]);
+    }
 
     // open specified file or read from stdin
-    if (argc > 1) {
-	    fin = open(argv[1], O_RDONLY);
+    if (argc > arg) {
+	    fin = open(argv[arg], O_RDONLY|O_CLOEXEC);
         if (fin == -1) {
-            perror(argv[1]);
+            perror(argv[arg]);
             exit(EXIT_FAILURE);
         }
     } else {
 	    fin = 0;
     }
-    
+    int interactive = isatty(fin);
+    init_job_control(interactive && fin == STDIN_FILENO);
+
     // remind user if they are running in interactive mode
-    if (isatty(fin)) {
+    if (interactive) {
         fputs("Welcome to my shell!\n", stderr);
-        fputs("mysh> ", stderr);
     }
 
     // set up storage for the current line
@@ -83,810 +797,5589 @@ int main(int argc, char **argv){
     lineSize = BUFSIZE;
     linePos = 0;
     status = 0;
-    int check = 0;
-    while ((bytes = read(fin, buffer, BUFSIZE)) > 0) {
-        check = 0;
-	    lstart = 0;
-        for (pos = 0; pos < bytes; ++pos) {
-            if (buffer[pos] == '\n') {
-                int thisLen = pos - lstart + 1;
-                append(buffer + lstart, thisLen);
-                token* head = make_tokens();
-                if(head != NULL){
-                    process* commands = process_tokens(head);
-                    if(commands == NULL){
-                        status = 1;
-                    }else{
-                        if((status = check_executables(commands)) == 0){
-                            status = execute_processes(commands);
-                        }
-                        free_commands(commands);
-                    }
-                    free_tokens(head);
-                }
-                linePos = 0;
-                lstart = pos + 1;
-                check = 1;
-            }
+    open_source(&source, fin);
+    // the line editor needs a terminal that is ours and understands escape sequences
+    char* term_name = getenv("TERM");
+    if(job_control && (term_name == NULL || strcmp(term_name, "dumb") != 0)){
+        source.edit = 1;
+        history_open();
+    }
+    char* cache_dir = getenv("MYSH_CACHE_DIR");
+    if(cache_dir != NULL && argc > arg && max_jobs == 0 && !interactive && source.map != NULL){
+        script_cache cache;
+        if(open_script_cache(&cache, &source, argv[arg], cache_dir) == 0){
+            status = run_cached(&cache, &source);
+            munmap(cache.map, cache.mapLen);
+            close_source(&source);
+            free(lineBuffer);
+            return EXIT_SUCCESS;
         }
-        if (lstart < bytes) {
-            // partial line at the end of the buffer
-            int thisLen = pos - lstart;
-            append(buffer + lstart, thisLen);
+    }
+    if(max_jobs > 0 && !interactive){
+        run_parallel(&source, max_jobs);
+        close_source(&source);
+        free(lineBuffer);
+        return EXIT_SUCCESS;
+    }
+    while (1) {
+        reap_jobs(interactive);
+        if(source.edit){
+            source.prompt = status == 0 ? "mysh> " : "!mysh> ";
+        } else if(interactive){
+            fputs(status == 0 ? "mysh> " : "!mysh> ", stderr);
         }
-        if (check != 0) {
-            if(isatty(fin)){
-                if(status == 0){
-                    fputs("mysh> ", stderr);
-                } else if(status == 1){
-                    fputs("!mysh> ", stderr);
-                } else if(status == 2){
-                    fputs("mysh: exiting\n", stderr);
-                    exit(EXIT_SUCCESS);
-                }
-            }
-            else if (status == 2){
-                exit(EXIT_SUCCESS);
+        if(!next_unit(&source, &line, &len)){
+            break;
+        }
+        status = run_line(line, len, status);
+        if(status == 2){
+            if(interactive){
+                fputs("mysh: exiting\n", stderr);
             }
+            exit(EXIT_SUCCESS);
         }
     }
-    if (linePos > 0) {
-        // file ended with partial line
-        append("\n", 1);
-        token* head = make_tokens();
-        if(head != NULL){
-            process* commands = process_tokens(head);
-            if(commands == NULL){
-                status = 1;
+    close_source(&source);
+    free(lineBuffer);
+    return EXIT_SUCCESS;
+}
+#endif
+
+// lines that change the shell itself can't run in a worker, so they wait for
+// everything before them and run in the shell; a wait line is how a script
+// marks that what follows depends on what came before
+int line_needs_shell(token* head){
+    int command = 1;
+    for(token* ptr = head; ptr != NULL; ptr = ptr->next){
+        if(command && (ptr->type == cd || ptr->type == set || ptr->type == hash
+            || ptr->type == jobctl || ptr->type == term || ptr->type == loop)){
+            return 1;
+        }
+        // assignments with no command after them set shell variables
+        if(command && ptr->type == assign && (ptr->next == NULL || is_separator(ptr->next))){
+            return 1;
+        }
+        command = command_follows(ptr, command);
+    }
+    return 0;
+}
+
+// runs up to max_jobs lines at once, each in a forked worker whose stdout and
+// stderr go to memfds; output is written out in line order as workers finish
+void run_parallel(line_source* source, int max_jobs){
+    batch_slot* slots = malloc(sizeof(batch_slot) * max_jobs);
+    int first = 0;
+    int count = 0;
+    int status = 0;
+    char* line;
+    int len;
+    while(next_unit(source, &line, &len)){
+        // only workers write records, so the parent starts every line's phases over
+        // itself, skipped lines included
+        trace_reset();
+        trace_line_start = trace_start();
+        token* head = make_tokens(line, len);
+        if(head == NULL){
+            arena_reset(&line_arena);
+            continue;
+        }
+        if(line_needs_shell(head)){
+            while(count > 0){
+                wait_worker(slots, first, count, max_jobs);
+                flush_workers(slots, &first, &count, max_jobs);
             }
-            else{
-                if((status = check_executables(commands)) == 0){
-                    status = execute_processes(commands);
-                }
-                free_commands(commands);
+            arena_reset(&line_arena);
+            // run_line tokenizes the line again and counts that itself
+            trace_reset();
+            status = run_line(line, len, status);
+            if(status == 2){
+                break;
             }
-            free_tokens(head);
+            continue;
         }
-    }  
-    free(lineBuffer);
-    close(fin);
-    return EXIT_SUCCESS;
+        while(count == max_jobs){
+            wait_worker(slots, first, count, max_jobs);
+            flush_workers(slots, &first, &count, max_jobs);
+        }
+        batch_slot* slot = &slots[(first + count) % max_jobs];
+        lines_run++;
+        if(start_worker(slot, head, line, len, status) == -1){
+            status = 1;
+        } else{
+            count++;
+        }
+        arena_reset(&line_arena);
+        flush_workers(slots, &first, &count, max_jobs);
+    }
+    while(count > 0){
+        wait_worker(slots, first, count, max_jobs);
+        flush_workers(slots, &first, &count, max_jobs);
+    }
+    free(slots);
 }
 
+int start_worker(batch_slot* slot, token* head, char* line, int len, int status){
+    slot->out = memfd_create("mysh-stdout", MFD_CLOEXEC);
+    slot->err = memfd_create("mysh-stderr", MFD_CLOEXEC);
+    if(slot->out == -1 || slot->err == -1){
+        perror("Error with memfd_create");
+        if(slot->out >= 0){close(slot->out);}
+        if(slot->err >= 0){close(slot->err);}
+        return -1;
+    }
+    slot->done = 0;
+    slot->pid = fork();
+    if(slot->pid == -1){
+        perror("Error with fork");
+        close(slot->out);
+        close(slot->err);
+        return -1;
+    }
+    if(slot->pid == 0){
+        dup2(slot->out, STDOUT_FILENO);
+        dup2(slot->err, STDERR_FILENO);
+        list* commands = parse_list(head);
+        status = commands == NULL ? 1 : run_list(commands, status);
+        // anything the line put in the background still belongs to its output
+        while(job_list != NULL){
+            foreground_job(job_list);
+        }
+        trace_line(line, len);
+        _exit(status);
+    }
+    return 0;
+}
 
-// add specified text the line buffer, expanding as necessary
-// assumes we are adding at least one byte
-void append(char *buf, int len){
-    int newPos = linePos + len;
-    
-    if (newPos > lineSize) {
-        lineSize *= 2;
-        assert(lineSize >= newPos);
-        lineBuffer = realloc(lineBuffer, lineSize);
-        if (lineBuffer == NULL) {
-            perror("line buffer");
-            exit(EXIT_FAILURE);
+// reaps one child; a worker is marked done, anything else belongs to a job the shell started
+void wait_worker(batch_slot* slots, int first, int count, int max_jobs){
+    int child_status;
+    pid_t pid = waitpid(-1, &child_status, 0);
+    if(pid == -1){
+        perror("Error with wait");
+        for(int i = 0; i < count; i++){
+            slots[(first + i) % max_jobs].done = 1;
+        }
+        return;
+    }
+    for(int i = 0; i < count; i++){
+        batch_slot* slot = &slots[(first + i) % max_jobs];
+        if(slot->pid == pid){
+            slot->done = 1;
+            slot->status = !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0;
+            return;
+        }
+    }
+    for(job* j = job_list; j != NULL; j = j->next){
+        for(int i = 0; i < j->stages; i++){
+            if(j->pids[i] == pid){
+                j->results[i] = !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0;
+                j->pids[i] = -1;
+            }
         }
     }
-    memcpy(lineBuffer + linePos, buf, len);
-    linePos = newPos;
 }
 
-void set_type(token* head){
-    token* ptr = head;
-    while(ptr != NULL){
-        if(strcmp(ptr->chrPtr, "cd") == 0){
-            ptr->type = cd;
-            ptr->wildcard = 0;
-        } else if(strcmp(ptr->chrPtr, "pwd") == 0){
-            ptr->type = pwd;
-            ptr->wildcard = 0;
-        } else if(strcmp(ptr->chrPtr, "<") == 0){
-            ptr->type = in;
-            ptr->wildcard = 0;
-        } else if(strcmp(ptr->chrPtr, ">") == 0){
-            ptr->type = out;
-            ptr->wildcard = 0;
-        } else if(strcmp(ptr->chrPtr, "|") == 0){
-            ptr->type = comb;
-            ptr->wildcard = 0;
-        } else if(strcmp(ptr->chrPtr, "exit") == 0){
-            ptr->type = term;
-            ptr->wildcard = 0;
-        } else{
-            int i = 0;
-            ptr->type = bare;
-            while(ptr->chrPtr[i] != '\0'){
-                if(ptr->chrPtr[i] == '/'){
-                    ptr->type = path;
-                    break;
-                }
-                i++;
+// writes out the finished lines at the front, stopping at the first one still running
+void flush_workers(batch_slot* slots, int* first, int* count, int max_jobs){
+    while(*count > 0 && slots[*first].done){
+        batch_slot* slot = &slots[*first];
+        copy_fd(slot->out, STDOUT_FILENO);
+        copy_fd(slot->err, STDERR_FILENO);
+        close(slot->out);
+        close(slot->err);
+        *first = (*first + 1) % max_jobs;
+        (*count)--;
+    }
+}
+
+// copies a whole file to fd, in the kernel with sendfile when it can
+void copy_fd(int from, int to){
+    off_t size = lseek(from, 0, SEEK_END);
+    off_t offset = 0;
+    while(offset < size){
+        ssize_t n = sendfile(to, from, &offset, size - offset);
+        if(n <= 0){
+            break;
+        }
+    }
+    if(offset < size){
+        char buffer[BUFSIZE];
+        ssize_t n;
+        lseek(from, offset, SEEK_SET);
+        while((n = read(from, buffer, BUFSIZE)) > 0){
+            if(write(to, buffer, n) != n){
+                break;
             }
-            i = 0;
-            ptr->wildcard = 0;
-            while(ptr->chrPtr[i] != '\0'){
-                if(ptr->chrPtr[i] == '*'){
-                    ptr->wildcard = 1;
-                    break;
+        }
+    }
+}
+
+// regular files are mapped and their lines are tokenized where they sit
+// stdin, pipes and terminals are read in BUFSIZE chunks into lineBuffer
+void open_source(line_source* src, int fd){
+    struct stat buf;
+    src->fd = fd;
+    src->map = NULL;
+    src->mapLen = 0;
+    src->mapPos = 0;
+    src->bufPos = 0;
+    src->bufLen = 0;
+    src->keepLine = 0;
+    src->edit = 0;
+    src->prompt = NULL;
+    if(fstat(fd, &buf) == 0 && S_ISREG(buf.st_mode) && buf.st_size > 0){
+        char* map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED){
+            madvise(map, buf.st_size, MADV_SEQUENTIAL);
+            src->map = map;
+            src->mapLen = buf.st_size;
+        }
+    }
+}
+
+void close_source(line_source* src){
+    if(src->map != NULL){
+        munmap(src->map, src->mapLen);
+    }
+    close(src->fd);
+}
+
+// hands back the next line without its newline, returns 0 once the input is used up
+int next_line(line_source* src, char** line, int* len){
+    if(src->map != NULL){
+        if(src->mapPos >= src->mapLen){
+            return 0;
+        }
+        char* start = src->map + src->mapPos;
+        char* end = memchr(start, '\n', src->mapLen - src->mapPos);
+        if(end == NULL){
+            // file ended with partial line
+            end = src->map + src->mapLen;
+        }
+        *line = start;
+        *len = end - start;
+        src->mapPos = end - src->map + 1;
+        return 1;
+    }
+    if(src->edit){
+        return edit_line(src, line, len);
+    }
+    int start = src->keepLine ? linePos : 0;
+    linePos = start;
+    while(1){
+        if(src->bufPos == src->bufLen){
+            src->bufLen = read(src->fd, src->buffer, BUFSIZE);
+            src->bufPos = 0;
+            if(src->bufLen <= 0){
+                src->bufLen = 0;
+                if(linePos == start){
+                    return 0;
                 }
-                i++;
-            } if(ptr->chrPtr[0] == '~' && (ptr->chrPtr[1] == '/' || ptr->chrPtr[1] == '\0')){
-                ptr->type = path;
-                int home_len = strlen(getenv("HOME"));
-                char* temp = malloc(sizeof(char) * (strlen(ptr->chrPtr) + 1));
-                strcpy(temp, ptr->chrPtr);
-                ptr->chrPtr = realloc(ptr->chrPtr, sizeof(char) * ((strlen(temp) + 1) + (home_len + 1)));
-                memcpy(ptr->chrPtr, getenv("HOME"), home_len);
-                memcpy((ptr->chrPtr) + home_len, (temp + 1), strlen(temp));
-                ptr->chrPtr[home_len + strlen(temp) - 1] = '\0';
-                free(temp);
+                // file ended with partial line
+                break;
             }
         }
-        ptr = ptr->next;
+        char* start = src->buffer + src->bufPos;
+        char* end = memchr(start, '\n', src->bufLen - src->bufPos);
+        if(end == NULL){
+            // partial line at the end of the buffer
+            append(start, src->bufLen - src->bufPos);
+            src->bufPos = src->bufLen;
+            continue;
+        }
+        if(end > start){
+            append(start, end - start);
+        }
+        src->bufPos = end - src->buffer + 1;
+        break;
     }
+    *line = lineBuffer;
+    *len = linePos;
+    return 1;
 }
 
+// runs one line and returns its status, blank lines keep the old one
+// everything built for the line lives in line_arena and goes away in one reset
+int run_line(char* line, int len, int status){
+    trace_line_start = trace_start();
+    return run_tokens(make_tokens(line, len), line, len, status);
+}
 
-token* make_tokens(void){
-    token* head = malloc(sizeof(token));
-    token* ptr = head;
-    ptr->chrPtr = (char *) malloc(sizeof(char));
-    ptr->prev = NULL;
-    int l = 0, r = linePos - 2;
-    int length = 0;
-    int ctr = 0;
-    char c;
-    assert(lineBuffer[linePos-1] == '\n');
-
-    // make token array
-    while (l <= r) {
-        length++;
-        c = lineBuffer[l];
-
-        if (c == ' '){
-            if(length == 1){
-                length = 0;
-            } else{
-                ptr->chrPtr = (char *) realloc(ptr->chrPtr, (length + 1) * sizeof(char));
-                ptr->chrPtr[length-1] = '\0';
-                token* temp = malloc(sizeof(token));
-                temp->prev = ptr;
-                temp->next = NULL;
-                temp->len = 0;
-                temp->chrPtr = (char * ) malloc(sizeof(char));
-                ptr->next = temp;
-                ptr = temp;
-                ctr++;
-                length = 0;
-            }
-        } else if(c == '|' || c == '>' || c == '<'){
-            if(length == 1){
-                ptr->chrPtr = (char *) realloc(ptr->chrPtr, 2 * sizeof(char));
-                ptr->chrPtr[length-1] = c;
-                ptr->chrPtr[length] = '\0';
-                ptr->len = length;
-                ptr->next = malloc(sizeof(token));
-                ptr->next->prev = ptr;
-                ptr->next->next = NULL;
-                ptr->next->len = 0;
-                ptr->next->chrPtr = (char * ) malloc(sizeof(char));
-                ptr = ptr->next;
-                ctr++;
-                length = 0;
-            } else{
-                ptr->chrPtr = (char *) realloc(ptr->chrPtr, length * sizeof(char));
-                ptr->chrPtr[length-1] = '\0';
-                ctr++;
-                ptr->next = malloc(sizeof(token));
-                ptr->next->prev = ptr;
-                ptr->next->next = NULL;
-                ptr->next->chrPtr = (char * ) malloc(2 * sizeof(char));
-                ptr->next->chrPtr[0] = c;
-                ptr->next->chrPtr[1] = '\0';
-                ptr->next->len = 1;
-                ptr = ptr->next;
-                ctr++;
-                ptr->next = malloc(sizeof(token));
-                ptr->next->prev = ptr;
-                ptr->next->next = NULL;
-                ptr->next->len = 0;
-                ptr->next->chrPtr = (char * ) malloc(sizeof(char));
-                ptr = ptr->next;
-                length = 0;
-            }
+int run_tokens(token* head, char* line, int len, int status){
+    interrupted = 0;
+    if(head != NULL){
+        list* commands = parse_list(head);
+        if(commands == NULL){
+            status = 1;
         } else{
-            ptr->len = length;
-            ptr->chrPtr = (char *) realloc(ptr->chrPtr, length * sizeof(char));
-            ptr->chrPtr[length-1] = c;
+            status = run_list(commands, status);
         }
-        ++l;
     }
-    if(ptr->len == 0){
-        ptr->prev->next = NULL;
-        free(ptr->chrPtr);
-        free(ptr);
+    lines_run++;
+    trace_line(line, len);
+    arena_reset(&line_arena);
+    return status;
+}
+
+void print_stats(void){
+    fprintf(stderr, "mysh: %ld lines, %ld arena allocations, %ld mallocs, %ld bytes peak\n",
+        lines_run, line_arena.allocs, line_arena.mallocs, line_arena.peak);
+}
+
+// spec is json or chrome, optionally followed by :file; records go to stderr otherwise
+void init_trace(const char* spec){
+    const char* file = strchr(spec, ':');
+    size_t len = file != NULL ? (size_t) (file - spec) : strlen(spec);
+    if(len == 6 && strncmp(spec, "chrome", 6) == 0){
+        trace_format = TRACE_CHROME;
+    } else if(len == 4 && strncmp(spec, "json", 4) == 0){
+        trace_format = TRACE_JSON;
+    } else{
+        fprintf(stderr, "mysh: MYSH_TRACE must be json or chrome, optionally followed by :file\n");
+        return;
     }
-    if(length > 0){
-        ctr++;
-        ptr->chrPtr = (char *) realloc(ptr->chrPtr, (length + 1) * sizeof(char));
-        ptr->chrPtr[length] = '\0';
-        ptr->next = NULL;
+    // records are single appending writes, so lines from -j workers don't interleave
+    if(file != NULL){
+        trace_fd = open(file + 1, O_CREAT|O_TRUNC|O_WRONLY|O_APPEND|O_CLOEXEC, 0644);
+    } else{
+        trace_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
     }
-    if(ctr == 0){
-        free(head->chrPtr);
-        free(head);
-        head = NULL;
+    trace_hist = mmap(NULL, sizeof(histogram) * NUM_PHASES, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    trace_events = open_memstream(&trace_text, &trace_size);
+    if(trace_fd == -1 || trace_hist == MAP_FAILED || trace_events == NULL){
+        perror("MYSH_TRACE");
+        trace_format = TRACE_NONE;
+        return;
     }
-    set_type(head);
-    return head;
+    for(int phase = 0; phase < NUM_PHASES; phase++){
+        trace_hist[phase].min = -1;
+    }
+    if(trace_format == TRACE_CHROME){
+        // the trace event format allows the closing bracket to be left off
+        write(trace_fd, "[\n", 2);
+    }
+    atexit(print_trace);
 }
 
-void free_tokens(token* head){
-    token* ptr = head;
-    while(ptr != NULL){
-        token* temp = ptr;
-        ptr = ptr->next;
-        free(temp->chrPtr);
-        free(temp);
+// a monotonic timestamp in ns, or 0 when not tracing
+long long trace_start(void){
+    if(trace_format == TRACE_NONE){
+        return 0;
     }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
-void free_commands(process* head){
-    process* ptr = head;
-    while(ptr != NULL){
-        process* temp = ptr;
-        ptr = ptr->next;
-        free_command(temp);
+// charges the time since start to a phase of the current line and its histogram
+void trace_end(int phase, long long start){
+    if(trace_format == TRACE_NONE){
+        return;
+    }
+    long long ns = trace_start() - start;
+    trace_ns[phase] += ns;
+    trace_calls[phase]++;
+    if(trace_format == TRACE_CHROME && phase != PHASE_LINE){
+        fprintf(trace_events, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+            phase_names[phase], start / 1e3, ns / 1e3, (int) getpid(), (int) getpid());
     }
+    int bucket = ns;
+    if(ns >= HIST_SUB){
+        int shift = 63 - __builtin_clzll(ns) - 4;
+        bucket = HIST_SUB + shift * HIST_SUB + ((ns >> shift) & (HIST_SUB - 1));
+    }
+    // -j workers update the same counters
+    histogram* h = &trace_hist[phase];
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    long long seen = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while(ns > seen && !__atomic_compare_exchange_n(&h->max, &seen, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    seen = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while((seen < 0 || ns < seen) && !__atomic_compare_exchange_n(&h->min, &seen, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-void free_command(process* command){
-    if(command->path_name != NULL){
-        free(command->path_name);
+// writes the record for a finished line and starts the next one from zero
+void trace_line(const char* line, int len){
+    if(trace_format == TRACE_NONE){
+        return;
     }
-    if(command->arguments != NULL){
-        for(int i = 0; i < command->argCount; i++){
-            free(command->arguments[i]);
+    trace_end(PHASE_LINE, trace_line_start);
+    while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')){
+        len--;
+    }
+    char* text = strndup(line, len);
+    if(trace_format == TRACE_CHROME){
+        fprintf(trace_events, "{\"name\":\"line\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"text\":",
+            trace_line_start / 1e3, trace_ns[PHASE_LINE] / 1e3, (int) getpid(), (int) getpid());
+        json_string(trace_events, text);
+        fprintf(trace_events, "}},\n");
+    } else{
+        fprintf(trace_events, "{\"line\":%ld,\"pid\":%d,\"start_ns\":%lld,\"text\":", lines_run, (int) getpid(), trace_line_start);
+        json_string(trace_events, text);
+        for(int phase = 0; phase < NUM_PHASES; phase++){
+            if(trace_calls[phase] > 0){
+                fprintf(trace_events, ",\"%s_ns\":%lld", phase_names[phase], trace_ns[phase]);
+            }
         }
-        free(command->arguments);
+        fprintf(trace_events, ",\"spawns\":%d}\n", trace_calls[PHASE_SPAWN]);
     }
-    if(command->input != NULL){
-        free(command->input);
+    free(text);
+    fflush(trace_events);
+    write(trace_fd, trace_text, trace_size);
+    rewind(trace_events);
+    trace_reset();
+}
+
+// the phases of a line count from zero
+void trace_reset(void){
+    memset(trace_ns, 0, sizeof(trace_ns));
+    memset(trace_calls, 0, sizeof(trace_calls));
+}
+
+// the value a bucket starts at
+long long bucket_value(int bucket){
+    if(bucket < HIST_SUB){
+        return bucket;
     }
-    if(command->output != NULL){
-        free(command->output);
+    int shift = (bucket - HIST_SUB) / HIST_SUB;
+    return (long long) (HIST_SUB + (bucket - HIST_SUB) % HIST_SUB) << shift;
+}
+
+long long percentile(histogram* h, double p){
+    long rank = (long) (h->count * p + 0.5);
+    long seen = 0;
+    for(int bucket = 0; bucket < HIST_BUCKETS; bucket++){
+        seen += h->buckets[bucket];
+        if(seen >= rank && seen > 0){
+            return bucket_value(bucket);
+        }
     }
-    free(command);
+    return h->max;
 }
 
-process* process_tokens(token* head){
-    process* command = (process *) malloc(sizeof(process));
-    command->type = head->type;
-    command->prev = NULL;
-    command->next = NULL;
-    command->input = NULL;
-    command->output = NULL;
-    command->arguments = NULL;
-    command->path_name = NULL;
-    token* ptr = head;
+void print_trace(void){
+    fprintf(stderr, "mysh: %-9s %8s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "min", "p50", "p90", "p99", "p99.9", "max");
+    for(int phase = 0; phase < NUM_PHASES; phase++){
+        histogram* h = &trace_hist[phase];
+        if(h->count == 0){
+            continue;
+        }
+        fprintf(stderr, "mysh: %-9s %8ld %8.1fus %8.1fus %8.1fus %8.1fus %8.1fus %8.1fus\n", phase_names[phase], h->count,
+            h->min / 1e3, percentile(h, 0.5) / 1e3, percentile(h, 0.9) / 1e3,
+            percentile(h, 0.99) / 1e3, percentile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+}
+
+void* arena_alloc(arena* a, size_t size){
+    // keep every block aligned for any type we put in it
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    arena_chunk* chunk = a->head;
+    if(chunk == NULL || chunk->used + size > chunk->size){
+        if(a->spare != NULL && a->spare->size >= size){
+            chunk = a->spare;
+            a->spare = NULL;
+        } else{
+            size_t chunk_size = ARENA_CHUNK;
+            while(chunk_size < size){
+                chunk_size *= 2;
+            }
+            chunk = malloc(sizeof(arena_chunk) + chunk_size);
+            if(chunk == NULL){
+                perror("arena");
+                exit(EXIT_FAILURE);
+            }
+            chunk->size = chunk_size;
+            a->mallocs++;
+        }
+        chunk->used = 0;
+        chunk->next = a->head;
+        a->head = chunk;
+    }
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    a->used += size;
+    a->allocs++;
+    return ptr;
+}
+
+char* arena_strndup(arena* a, const char* str, int len){
+    char* copy = arena_alloc(a, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// a line that needed more than one chunk gets a single chunk that size from now on,
+// so after the first few lines nothing is malloc'd at all
+void arena_reset(arena* a){
+    if(a->used > a->peak){
+        a->peak = a->used;
+    }
+    free(a->spare);
+    a->spare = NULL;
+    if(a->head != NULL && a->head->next != NULL){
+        size_t total = 0;
+        while(a->head != NULL){
+            arena_chunk* temp = a->head;
+            a->head = temp->next;
+            total += temp->size;
+            free(temp);
+        }
+        a->head = malloc(sizeof(arena_chunk) + total);
+        if(a->head == NULL){
+            perror("arena");
+            exit(EXIT_FAILURE);
+        }
+        a->head->size = total;
+        a->head->next = NULL;
+        a->mallocs++;
+    }
+    if(a->head != NULL){
+        a->head->used = 0;
+    }
+    a->used = 0;
+}
+
+void arena_get_mark(arena* a, arena_mark* mark){
+    mark->head = a->head;
+    mark->chunkUsed = a->head == NULL ? 0 : a->head->used;
+    mark->used = a->used;
+}
+
+// frees everything allocated since the mark, keeping one chunk back so a loop
+// that spills out of its chunk every time round doesn't malloc every time
+void arena_rewind(arena* a, arena_mark* mark){
+    if(a->used > a->peak){
+        a->peak = a->used;
+    }
+    while(a->head != mark->head){
+        arena_chunk* temp = a->head;
+        a->head = temp->next;
+        if(a->spare == NULL || temp->size > a->spare->size){
+            free(a->spare);
+            a->spare = temp;
+        } else{
+            free(temp);
+        }
+    }
+    if(a->head != NULL){
+        a->head->used = mark->chunkUsed;
+    }
+    a->used = mark->used;
+}
+
+// adds an argument to the command, doubling the vector when it fills up
+// arguments[argCount] is always NULL so the vector can go straight to exec
+void add_argument(process* proc, char* arg){
+    if(proc->argCount + 1 >= proc->argCap){
+        int cap = proc->argCap == 0 ? 8 : proc->argCap * 2;
+        char** args = arena_alloc(&line_arena, sizeof(char *) * cap);
+        if(proc->argCount > 0){
+            memcpy(args, proc->arguments, sizeof(char *) * proc->argCount);
+        }
+        proc->arguments = args;
+        proc->argCap = cap;
+    }
+    proc->arguments[proc->argCount++] = arg;
+    proc->arguments[proc->argCount] = NULL;
+}
+
+// a line together with the bodies of its here-documents, which follow it
+// up to a line holding just the delimiter; a line that opens a loop also takes
+// every line up to the done that closes it. the unit keeps its newlines
+int next_unit(line_source* src, char** line, int* len){
+    if(!next_line(src, line, len)){
+        return 0;
+    }
+    char* unit = *line;
+    int unitLen = *len;
+    int from = 0;
+    int depth = 0;
+    while(1){
+        depth += loop_depth(unit + from, unitLen - from);
+        read_bodies(src, &unit, &unitLen, from);
+        char* next;
+        int nextLen;
+        if(depth <= 0 || !unit_line(src, &unit, &unitLen, &next, &nextLen)){
+            break;
+        }
+        from = next - unit;
+    }
+    *line = unit;
+    *len = unitLen;
+    return 1;
+}
+
+// reads the bodies of the here-documents named on the unit's line starting at from
+void read_bodies(line_source* src, char** unit, int* unitLen, int from){
+    // the delimiters are copied, a buffered line moves as it grows
+    char** delimiters = NULL;
+    int* lens = NULL;
+    int count = 0;
+    int cap = 0;
+    char* line = *unit + from;
+    int len = *unitLen - from;
+    for(int i = 0; i + 1 < len; i++){
+        if(line[i] != '<' || line[i + 1] != '<'){
+            continue;
+        }
+        if(i + 2 < len && line[i + 2] == '<'){
+            i += 2;
+            continue;
+        }
+        int start = i + 2;
+        while(start < len && char_class[(unsigned char) line[start]] == CH_BLANK){
+            start++;
+        }
+        int end = word_end(line, start, len);
+        if(end == start){
+            continue;
+        }
+        if(count == cap){
+            cap = cap == 0 ? 16 : cap * 2;
+            char** moreDelims = arena_alloc(&line_arena, sizeof(char *) * cap);
+            int* moreLens = arena_alloc(&line_arena, sizeof(int) * cap);
+            if(count > 0){
+                memcpy(moreDelims, delimiters, sizeof(char *) * count);
+                memcpy(moreLens, lens, sizeof(int) * count);
+            }
+            delimiters = moreDelims;
+            lens = moreLens;
+        }
+        int skip = heredoc_delimiter(line + start, end - start, &lens[count]);
+        delimiters[count] = arena_strndup(&line_arena, line + start + skip, lens[count]);
+        count++;
+        i = end - 1;
+    }
+    for(int d = 0; d < count; d++){
+        char* next;
+        int nextLen;
+        while(unit_line(src, unit, unitLen, &next, &nextLen)){
+            if(nextLen == lens[d] && memcmp(next, delimiters[d], nextLen) == 0){
+                break;
+            }
+        }
+    }
+}
+
+// reads one more line onto the end of the unit, which a buffered source may move
+int unit_line(line_source* src, char** unit, int* unitLen, char** next, int* nextLen){
+    if(src->map == NULL){
+        if(src->edit){
+            src->prompt = "> ";
+        } else if(isatty(src->fd)){
+            fputs("> ", stderr);
+        }
+        append("\n", 1);
+        src->keepLine = 1;
+    }
+    int before = linePos;
+    int more = next_line(src, next, nextLen);
+    src->keepLine = 0;
+    if(!more){
+        if(src->map == NULL){
+            linePos--;
+        }
+        return 0;
+    }
+    if(src->map == NULL){
+        *unit = lineBuffer;
+        *unitLen = linePos;
+        *next = lineBuffer + before;
+        *nextLen = linePos - before;
+    } else{
+        *unitLen = *next + *nextLen - *unit;
+    }
+    return 1;
+}
+
+// how many loops the line opens less how many it closes, going by the for,
+// while and done words where a command would start
+int loop_depth(const char* line, int len){
+    int depth = 0;
+    int command = 1;
+    int l = 0;
+    while(l < len){
+        unsigned char class = char_class[(unsigned char) line[l]];
+        if(class == CH_BLANK){
+            l++;
+            continue;
+        }
+        if(class == CH_SPECIAL){
+            command = line[l] != '<' && line[l] != '>';
+            l++;
+            continue;
+        }
+        int end = word_span(line, l, len);
+        if(command){
+            int wordLen = end - l;
+            if((wordLen == 3 && memcmp(line + l, "for", 3) == 0) || (wordLen == 5 && memcmp(line + l, "while", 5) == 0)){
+                depth++;
+            } else if(wordLen == 4 && memcmp(line + l, "done", 4) == 0){
+                depth--;
+            }
+            command = (wordLen == 5 && memcmp(line + l, "while", 5) == 0) || (wordLen == 2 && memcmp(line + l, "do", 2) == 0);
+        }
+        l = end;
+    }
+    return depth;
+}
+
+// the delimiter may be quoted, which only means its quotes aren't part of it
+// returns how much to skip at the front and sets the length that is left
+int heredoc_delimiter(const char* word, int len, int* left){
+    if(len >= 2 && (word[0] == '\'' || word[0] == '"') && word[len - 1] == word[0]){
+        *left = len - 2;
+        return 1;
+    }
+    *left = len;
+    return 0;
+}
+
+// add specified text the line buffer, expanding as necessary
+// assumes we are adding at least one byte
+void append(char *buf, int len){
+    int newPos = linePos + len;
+    
+    if (newPos > lineSize) {
+        while(lineSize < newPos){
+            lineSize *= 2;
+        }
+        lineBuffer = realloc(lineBuffer, lineSize);
+        if (lineBuffer == NULL) {
+            perror("line buffer");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(lineBuffer + linePos, buf, len);
+    linePos = newPos;
+}
+
+// MYSH_HISTFILE names the history file, ~/.mysh_history otherwise; an empty
+// name or a file that can't be opened leaves the editor without history
+void history_open(void){
+    char* name = getenv("MYSH_HISTFILE");
+    char* path = NULL;
+    if(name == NULL){
+        char* home = getenv("HOME");
+        if(home == NULL){
+            return;
+        }
+        path = malloc(strlen(home) + sizeof("/.mysh_history"));
+        if(path == NULL){
+            return;
+        }
+        sprintf(path, "%s/.mysh_history", home);
+        name = path;
+    }
+    if(name[0] != '\0'){
+        hist.fd = open(name, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+        if(hist.fd == -1){
+            perror(name);
+        }
+    }
+    free(path);
+    hist.cap = 1024;
+    hist.starts = malloc(hist.cap * sizeof(size_t));
+    if(hist.starts == NULL){
+        perror("history");
+        exit(EXIT_FAILURE);
+    }
+    hist.starts[0] = 0;
+}
+
+// forgets everything read from the file so it is read again from the start
+void history_reset(void){
+    if(hist.map != NULL){
+        munmap(hist.map, hist.mapLen);
+    }
+    hist.map = NULL;
+    hist.mapLen = 0;
+    hist.count = 0;
+    for(int i = 0; i < hist.trigramCap; i++){
+        free(hist.trigrams[i].ids);
+    }
+    free(hist.trigrams);
+    hist.trigrams = NULL;
+    hist.trigramCap = 0;
+    hist.trigramUsed = 0;
+    hist.indexed = 0;
+}
+
+// picks up what this and other sessions appended since the last look; only
+// whole lines count, so an entry being written waits for the next time
+void history_sync(void){
+    struct stat buf;
+    if(hist.fd == -1 || fstat(hist.fd, &buf) == -1){
+        return;
+    }
+    size_t size = buf.st_size;
+    if(size < hist.mapLen){
+        // someone cut the file down
+        history_reset();
+    }
+    if(size > hist.mapLen){
+        char* map = hist.map == NULL ? mmap(NULL, size, PROT_READ, MAP_SHARED, hist.fd, 0)
+            : mremap(hist.map, hist.mapLen, size, MREMAP_MAYMOVE);
+        if(map == MAP_FAILED){
+            history_reset();
+            return;
+        }
+        hist.map = map;
+        hist.mapLen = size;
+    }
+    size_t pos = hist.starts[hist.count];
+    while(pos < hist.mapLen){
+        char* end = memchr(hist.map + pos, '\n', hist.mapLen - pos);
+        if(end == NULL){
+            break;
+        }
+        if(hist.count + 2 > hist.cap){
+            size_t* starts = realloc(hist.starts, hist.cap * 2 * sizeof(size_t));
+            if(starts == NULL){
+                break;
+            }
+            hist.starts = starts;
+            hist.cap *= 2;
+        }
+        pos = end - hist.map + 1;
+        hist.starts[++hist.count] = pos;
+    }
+}
+
+// the map is shared with a file other sessions can cut down, and reading a page
+// past its end is SIGBUS, so entries are only read right after this check;
+// returns 1 when the history was read again and ids from before mean nothing
+int history_truncated(void){
+    struct stat buf;
+    if(hist.map == NULL || fstat(hist.fd, &buf) == -1 || (size_t) buf.st_size >= hist.mapLen){
+        return 0;
+    }
+    history_sync();
+    return 1;
+}
+
+char* history_entry(int id, int* len){
+    *len = hist.starts[id + 1] - hist.starts[id] - 1;
+    return hist.map + hist.starts[id];
+}
+
+// blank lines and repeats of the newest entry are left out
+void history_add(const char* line, int len){
+    if(hist.fd == -1){
+        return;
+    }
+    int blank = 1;
+    for(int i = 0; i < len; i++){
+        if(char_class[(unsigned char) line[i]] != CH_BLANK){
+            blank = 0;
+            break;
+        }
+    }
+    if(blank){
+        return;
+    }
+    history_sync();
+    if(hist.count > 0){
+        int lastLen;
+        char* last = history_entry(hist.count - 1, &lastLen);
+        if(lastLen == len && memcmp(last, line, len) == 0){
+            return;
+        }
+    }
+    char* entry = malloc(len + 1);
+    if(entry == NULL){
+        return;
+    }
+    memcpy(entry, line, len);
+    entry[len] = '\n';
+    if(write(hist.fd, entry, len + 1) != len + 1){
+        perror("history");
+    }
+    free(entry);
+}
+
+// open addressing in a table that is kept at most half full
+trigram_list* trigram_slot(uint32_t key){
+    uint32_t mask = hist.trigramCap - 1;
+    uint32_t i = key * 2654435761u;
+    i = (i ^ i >> 16) & mask;
+    while(hist.trigrams[i].key != 0 && hist.trigrams[i].key != key){
+        i = (i + 1) & mask;
+    }
+    return &hist.trigrams[i];
+}
+
+// entries are indexed oldest first, so each list stays sorted and a trigram
+// seen twice in one entry is only the same id again
+void trigram_add(uint32_t key, uint32_t id){
+    if((hist.trigramUsed + 1) * 2 > hist.trigramCap){
+        trigram_list* old = hist.trigrams;
+        int oldCap = hist.trigramCap;
+        hist.trigramCap = oldCap == 0 ? 4096 : oldCap * 2;
+        hist.trigrams = calloc(hist.trigramCap, sizeof(trigram_list));
+        if(hist.trigrams == NULL){
+            perror("history");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < oldCap; i++){
+            if(old[i].key != 0){
+                *trigram_slot(old[i].key) = old[i];
+            }
+        }
+        free(old);
+    }
+    trigram_list* list = trigram_slot(key);
+    if(list->key == 0){
+        list->key = key;
+        hist.trigramUsed++;
+    } else if(list->ids[list->count - 1] == id){
+        return;
+    }
+    if(list->count == list->cap){
+        list->cap = list->cap == 0 ? 4 : list->cap * 2;
+        list->ids = realloc(list->ids, list->cap * sizeof(uint32_t));
+        if(list->ids == NULL){
+            perror("history");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->ids[list->count++] = id;
+}
+
+// adds the entries that came in since the index was last used
+void history_index(void){
+    for(; hist.indexed < hist.count; hist.indexed++){
+        int len;
+        unsigned char* text = (unsigned char*) history_entry(hist.indexed, &len);
+        for(int i = 0; i + 2 < len; i++){
+            trigram_add((text[i] << 16 | text[i + 1] << 8 | text[i + 2]) + 1, hist.indexed);
+        }
+    }
+}
+
+// the newest entry before the given one that holds the query, or -1; a query
+// of three bytes or more only looks at the entries holding its rarest trigram
+int history_search(const char* query, int qlen, int before){
+    if(qlen == 0){
+        return -1;
+    }
+    if(qlen < 3){
+        for(int id = before - 1; id >= 0; id--){
+            int len;
+            char* text = history_entry(id, &len);
+            if(memmem(text, len, query, qlen) != NULL){
+                return id;
+            }
+        }
+        return -1;
+    }
+    history_index();
+    if(hist.trigramCap == 0){
+        return -1;
+    }
+    const unsigned char* bytes = (const unsigned char*) query;
+    trigram_list* rarest = NULL;
+    for(int i = 0; i + 2 < qlen; i++){
+        trigram_list* list = trigram_slot((bytes[i] << 16 | bytes[i + 1] << 8 | bytes[i + 2]) + 1);
+        if(list->key == 0){
+            return -1;
+        }
+        if(rarest == NULL || list->count < rarest->count){
+            rarest = list;
+        }
+    }
+    int low = 0, high = rarest->count;
+    while(low < high){
+        int mid = (low + high) / 2;
+        if(rarest->ids[mid] < (uint32_t) before){
+            low = mid + 1;
+        } else{
+            high = mid;
+        }
+    }
+    for(int i = low - 1; i >= 0; i--){
+        int len;
+        char* text = history_entry(rarest->ids[i], &len);
+        if(memmem(text, len, query, qlen) != NULL){
+            return rarest->ids[i];
+        }
+    }
+    return -1;
+}
+
+int read_byte(void){
+    unsigned char c;
+    ssize_t n;
+    while((n = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR);
+    return n == 1 ? c : -1;
+}
+
+// one key, with the escape sequences terminals send for arrows and the like
+// turned into KEY_ codes; -1 once the terminal is gone
+int read_key(void){
+    int c = read_byte();
+    if(c != 27){
+        return c;
+    }
+    int kind = read_byte();
+    int code = read_byte();
+    if(kind == '[' && code >= '0' && code <= '9'){
+        if(read_byte() != '~'){
+            return 27;
+        }
+        switch(code){
+            case '1': case '7': return KEY_HOME;
+            case '4': case '8': return KEY_END;
+            case '3': return KEY_DELETE;
+        }
+        return 27;
+    }
+    if(kind == '[' || kind == 'O'){
+        switch(code){
+            case 'A': return KEY_UP;
+            case 'B': return KEY_DOWN;
+            case 'C': return KEY_RIGHT;
+            case 'D': return KEY_LEFT;
+            case 'H': return KEY_HOME;
+            case 'F': return KEY_END;
+        }
+    }
+    return 27;
+}
+
+// redraws the prompt and the line, scrolled sideways when it is wider than the terminal
+void editor_refresh(line_editor* ed){
+    struct winsize size;
+    int cols = ioctl(STDERR_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    int promptLen = strlen(ed->prompt);
+    char* start = ed->buf;
+    int len = ed->len;
+    int pos = ed->pos;
+    while(promptLen + pos >= cols && pos > 0){
+        start++;
+        len--;
+        pos--;
+    }
+    if(promptLen + len > cols){
+        len = cols > promptLen ? cols - promptLen : 0;
+    }
+    byte_buffer out = {0};
+    char move[32];
+    buffer_add(&out, "\r", 1);
+    buffer_add(&out, ed->prompt, promptLen);
+    buffer_add(&out, start, len);
+    buffer_add(&out, move, snprintf(move, sizeof(move), "\x1b[0K\r\x1b[%dC", promptLen + pos));
+    write_all(STDERR_FILENO, out.data, out.len);
+    free(out.data);
+}
+
+void editor_insert(line_editor* ed, const char* text, int len){
+    if(len == 0){
+        return;
+    }
+    if(ed->len + len > ed->cap){
+        while(ed->len + len > ed->cap){
+            ed->cap = ed->cap == 0 ? 128 : ed->cap * 2;
+        }
+        ed->buf = realloc(ed->buf, ed->cap);
+        if(ed->buf == NULL){
+            perror("line editor");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memmove(ed->buf + ed->pos + len, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, text, len);
+    ed->len += len;
+    ed->pos += len;
+}
+
+void editor_set(line_editor* ed, const char* text, int len){
+    ed->len = 0;
+    ed->pos = 0;
+    editor_insert(ed, text, len);
+}
+
+void editor_delete(line_editor* ed, int from, int to){
+    if(from == to){
+        return;
+    }
+    memmove(ed->buf + from, ed->buf + to, ed->len - to);
+    ed->len -= to - from;
+    ed->pos = from;
+}
+
+// ^R: every key typed narrows the search and ^R again moves on to older matches;
+// returns 1 when the match should run right away
+int editor_search(line_editor* ed){
+    char query[256];
+    int qlen = 0;
+    int match = -1;
+    int matchPos = 0; // where the query last matched, kept while it matches nothing
+    int failed = 0;
+    while(1){
+        char prompt[300];
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ", failed ? "failed " : "", qlen, query);
+        line_editor view = *ed;
+        view.prompt = prompt;
+        if(match >= 0){
+            view.buf = history_entry(match, &view.len);
+            view.pos = matchPos;
+        }
+        editor_refresh(&view);
+        int key = read_key();
+        if(history_truncated()){
+            match = -1;
+        }
+        if(key == 18){
+            if(qlen > 0){
+                int found = history_search(query, qlen, match >= 0 ? match : hist.count);
+                if(found >= 0){
+                    match = found;
+                    matchPos = match_position(match, query, qlen);
+                }
+                failed = found < 0;
+            }
+        } else if(key == 127 || key == 8){
+            if(qlen > 0){
+                qlen--;
+            }
+            match = history_search(query, qlen, hist.count);
+            if(match >= 0){
+                matchPos = match_position(match, query, qlen);
+            }
+            failed = qlen > 0 && match < 0;
+        } else if(key >= 32 && key < 256 && key != 127){
+            if(qlen < (int) sizeof(query) - 1){
+                query[qlen++] = key;
+                // the current match may still hold the longer query
+                int found = history_search(query, qlen, match >= 0 ? match + 1 : hist.count);
+                if(found >= 0){
+                    match = found;
+                    matchPos = match_position(match, query, qlen);
+                }
+                failed = found < 0;
+            }
+        } else if(key == 7 || key == 27 || key == 3){
+            // ^G, escape and ^C leave the line as it was
+            return 0;
+        } else{
+            if(match >= 0){
+                int len;
+                char* text = history_entry(match, &len);
+                editor_set(ed, text, len);
+            }
+            return key == '\r' || key == '\n';
+        }
+    }
+}
+
+// where the query sits in a history entry history_search said holds it
+int match_position(int entry, const char* query, int qlen){
+    int len;
+    char* text = history_entry(entry, &len);
+    char* at = memmem(text, len, query, qlen);
+    return at == NULL ? 0 : at - text;
+}
+
+// reads a line from the terminal with editing, history and search; the terminal
+// is raw only while the line is edited so commands run with the user's settings
+int edit_line(line_source* src, char** line, int* len){
+    int start = src->keepLine ? linePos : 0;
+    linePos = start;
+    if(tcgetattr(src->fd, &cooked_termios) == -1){
+        src->edit = 0;
+        fputs(src->prompt, stderr);
+        return next_line(src, line, len);
+    }
+    struct termios raw = cooked_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(src->fd, TCSADRAIN, &raw);
+
+    line_editor ed = {NULL, 0, 0, 0, src->prompt};
+    char* saved = NULL;
+    int savedLen = 0;
+    int result = 1;
+    // entries other sessions add while this line is edited show up with the next one
+    history_sync();
+    int browse = hist.count;
+    editor_refresh(&ed);
+    while(1){
+        int key = read_key();
+        if(key == 18){
+            key = editor_search(&ed) ? '\r' : 0;
+        }
+        if(key == -1 && ed.len > 0){
+            key = '\r';
+        }
+        if(key == -1 || (key == 4 && ed.len == 0)){
+            result = 0;
+            break;
+        }
+        if(key == '\r' || key == '\n'){
+            break;
+        }
+        switch(key){
+            case 3:
+                // ^C drops the line
+                write_all(STDERR_FILENO, "^C\n", 3);
+                ed.len = 0;
+                ed.pos = 0;
+                browse = hist.count;
+                break;
+            case 127: case 8:
+                if(ed.pos > 0){
+                    editor_delete(&ed, ed.pos - 1, ed.pos);
+                }
+                break;
+            case 4: case KEY_DELETE:
+                if(ed.pos < ed.len){
+                    editor_delete(&ed, ed.pos, ed.pos + 1);
+                }
+                break;
+            case 1: case KEY_HOME:
+                ed.pos = 0;
+                break;
+            case 5: case KEY_END:
+                ed.pos = ed.len;
+                break;
+            case 2: case KEY_LEFT:
+                if(ed.pos > 0){
+                    ed.pos--;
+                }
+                break;
+            case 6: case KEY_RIGHT:
+                if(ed.pos < ed.len){
+                    ed.pos++;
+                }
+                break;
+            case 11:
+                ed.len = ed.pos;
+                break;
+            case 21:
+                editor_delete(&ed, 0, ed.pos);
+                break;
+            case 23:{
+                int from = ed.pos;
+                while(from > 0 && ed.buf[from - 1] == ' '){
+                    from--;
+                }
+                while(from > 0 && ed.buf[from - 1] != ' '){
+                    from--;
+                }
+                editor_delete(&ed, from, ed.pos);
+                break;
+            }
+            case 12:
+                write_all(STDERR_FILENO, "\x1b[H\x1b[2J", 7);
+                break;
+            case 9:
+                complete_line(&ed);
+                break;
+            case 16: case 14: case KEY_UP: case KEY_DOWN:{
+                // the line being typed is kept while older ones are looked at
+                if(history_truncated()){
+                    browse = hist.count;
+                }
+                int next = browse + (key == 16 || key == KEY_UP ? -1 : 1);
+                if(next < 0 || next > hist.count){
+                    break;
+                }
+                if(browse == hist.count){
+                    free(saved);
+                    saved = malloc(ed.len + 1);
+                    if(saved != NULL && ed.len > 0){
+                        memcpy(saved, ed.buf, ed.len);
+                    }
+                    savedLen = saved != NULL ? ed.len : 0;
+                }
+                browse = next;
+                if(browse == hist.count){
+                    editor_set(&ed, saved, savedLen);
+                } else{
+                    int entryLen;
+                    char* entry = history_entry(browse, &entryLen);
+                    editor_set(&ed, entry, entryLen);
+                }
+                break;
+            }
+            default:
+                if(key >= 32 && key < 256 && key != 127){
+                    char c = key;
+                    editor_insert(&ed, &c, 1);
+                }
+        }
+        editor_refresh(&ed);
+    }
+    ed.pos = ed.len;
+    editor_refresh(&ed);
+    write_all(STDERR_FILENO, "\n", 1);
+    tcsetattr(src->fd, TCSADRAIN, &cooked_termios);
+    if(result){
+        if(ed.len > 0){
+            append(ed.buf, ed.len);
+            // the body of a here-document comes back with its first line
+            if(start == 0){
+                history_add(ed.buf, ed.len);
+            }
+        }
+        *line = lineBuffer;
+        *len = linePos;
+    }
+    free(ed.buf);
+    free(saved);
+    return result;
+}
+
+// tokens are views into the line, so keywords are compared by length and bytes
+int token_is(token* tok, const char* word){
+    return strncmp(tok->chrPtr, word, tok->len) == 0 && word[tok->len] == '\0';
+}
+
+// copies a token out of the line once it is actually needed as a C string
+char* token_string(token* tok){
+    return arena_strndup(&line_arena, tok->chrPtr, tok->len);
+}
+
+void set_type(token* head){
+    token* ptr = head;
+    int command = 1;
+    for(; ptr != NULL; command = command_follows(ptr, command), ptr = ptr->next){
+        // the tokenizer already typed the special characters
+        if(ptr->type != bare){
+            continue;
+        }
+        ptr->wildcard = 0;
+        int nameLen = var_name_length(ptr->chrPtr, ptr->len);
+        if(command && nameLen > 0 && nameLen < ptr->len && ptr->chrPtr[nameLen] == '='){
+            ptr->type = assign;
+            continue;
+        }
+        if(command){
+            ptr->type = keyword_type(ptr);
+            if(ptr->type != bare){
+                continue;
+            }
+        }
+        builtin_info* b = find_builtin(ptr->chrPtr, ptr->len);
+        if(b != NULL){
+            ptr->type = b->type;
+        } else{
+            if(memchr(ptr->chrPtr, '/', ptr->len) != NULL){
+                ptr->type = path;
+            }
+            ptr->wildcard = word_has_wildcard(ptr->chrPtr, ptr->len);
+            // ~ becomes $HOME when the word is expanded
+            if(ptr->chrPtr[0] == '~' && (ptr->len == 1 || ptr->chrPtr[1] == '/')){
+                ptr->type = path;
+            }
+        }
+    }
+}
+
+// returns the index of the first blank or special character in line[l..r)
+// sixteen bytes at a time where SSE2 is available
+int word_end(const char* line, int l, int r){
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i bar = _mm_set1_epi8('|');
+    const __m128i less = _mm_set1_epi8('<');
+    const __m128i greater = _mm_set1_epi8('>');
+    const __m128i ampersand = _mm_set1_epi8('&');
+    const __m128i semicolon = _mm_set1_epi8(';');
+    while(l + 16 <= r){
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (line + l));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, newline),
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, bar),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, less),
+                        _mm_or_si128(_mm_cmpeq_epi8(chunk, greater),
+                            _mm_or_si128(_mm_cmpeq_epi8(chunk, ampersand), _mm_cmpeq_epi8(chunk, semicolon)))))));
+        int mask = _mm_movemask_epi8(hits);
+        if(mask != 0){
+            return l + __builtin_ctz(mask);
+        }
+        l += 16;
+    }
+#endif
+    while(l < r && char_class[(unsigned char) line[l]] == 0){
+        ++l;
+    }
+    return l;
+}
+
+// splits the line into words and the operators |, <, >, &, ;, && and ||
+// tokens point straight into the line, nothing is copied here
+token* make_tokens(char* line, int r){
+    token* head = NULL;
+    token* tail = NULL;
+    token* first = NULL; // the first token on the current line
+    int l = 0;
+    long long start = trace_start();
+    // here-document bodies follow the line that names them, and the lines
+    // of a loop follow each other
+    char* newline = memchr(line, '\n', r);
+    int lineEnd = newline == NULL ? r : newline - line;
+
+    while (l < r) {
+        unsigned char class = char_class[(unsigned char) line[l]];
+        int at = l;
+        if(l == lineEnd){
+            l = attach_bodies(first, line, l + 1, r);
+            first = NULL;
+            newline = memchr(line + l, '\n', r - l);
+            lineEnd = newline == NULL ? r : newline - line;
+            if(tail == NULL || is_separator(tail) || tail->type == comb){
+                continue;
+            }
+        } else if (class == CH_BLANK){
+            ++l;
+            continue;
+        }
+        token* temp = arena_alloc(&line_arena, sizeof(token));
+        temp->chrPtr = line + at;
+        temp->wildcard = 0;
+        if(at != l){
+            // inside a unit a newline ends the command the way ; does
+            temp->type = semi;
+            temp->len = 1;
+        } else if(class == CH_SPECIAL){
+            char c = line[l];
+            temp->type = c == '|' ? comb : c == '<' ? in : c == '>' ? out : c == ';' ? semi : amp;
+            temp->len = 1;
+            ++l;
+            if(l < r && line[l] == c && (c == '|' || c == '&')){
+                temp->type = c == '|' ? orif : andif;
+                temp->len = 2;
+                ++l;
+            } else if(c == '<' && l < r && line[l] == '<'){
+                temp->type = heredoc;
+                temp->len = 2;
+                ++l;
+                if(l < r && line[l] == '<'){
+                    temp->type = herestr;
+                    temp->len = 3;
+                    ++l;
+                }
+            }
+        } else{
+            temp->type = bare;
+            int end = word_span(line, l, r);
+            temp->len = end - l;
+            l = end;
+        }
+        temp->prev = tail;
+        temp->next = NULL;
+        if(tail == NULL){
+            head = temp;
+        } else{
+            tail->next = temp;
+        }
+        tail = temp;
+        if(first == NULL && temp->type != semi){
+            first = temp;
+        }
+    }
+    attach_bodies(first, line, r, r);
+    trace_end(PHASE_TOKENIZE, start);
+    start = trace_start();
+    set_type(head);
+    trace_end(PHASE_TYPE, start);
+    return head;
+}
+
+// the word after << on one line is swapped for the body it delimits, the bodies
+// come in order from bodies on; returns where the line after them starts
+int attach_bodies(token* first, char* line, int bodies, int r){
+    for(token* ptr = first; ptr != NULL; ptr = ptr->next){
+        if((ptr->type != heredoc && ptr->type != herestr) || ptr->next == NULL || ptr->next->type != bare){
+            continue;
+        }
+        token* word = ptr->next;
+        word->type = here;
+        if(ptr->type == herestr){
+            continue;
+        }
+        int len;
+        char* delimiter = word->chrPtr + heredoc_delimiter(word->chrPtr, word->len, &len);
+        word->chrPtr = line + bodies;
+        word->len = r - bodies;
+        while(bodies < r){
+            char* end = memchr(line + bodies, '\n', r - bodies);
+            int lineLen = (end == NULL ? r : end - line) - bodies;
+            if(lineLen == len && memcmp(line + bodies, delimiter, len) == 0){
+                word->len = line + bodies - word->chrPtr;
+                bodies += lineLen + 1;
+                break;
+            }
+            bodies += lineLen + 1;
+        }
+    }
+    return bodies < r ? bodies : r;
+}
+
+// for and while open a loop and do and done mark out its body, but only where a
+// command would start; anywhere else they are plain words
+token_type keyword_type(token* tok){
+    if(tok->len == 3 && memcmp(tok->chrPtr, "for", 3) == 0){
+        return loop;
+    } else if(tok->len == 5 && memcmp(tok->chrPtr, "while", 5) == 0){
+        return loop;
+    } else if((tok->len == 2 && memcmp(tok->chrPtr, "do", 2) == 0) || (tok->len == 4 && memcmp(tok->chrPtr, "done", 4) == 0)){
+        return body;
+    }
+    return bare;
+}
+
+process* process_tokens(token* head){
+    process* command = arena_alloc(&line_arena, sizeof(process));
+    command->env = NULL;
+    command->envCount = 0;
+    // NAME=value words in front of a command only go into its environment,
+    // on their own they set shell variables
+    token* word = head;
+    while(word != NULL && word->type == assign){
+        word = word->next;
+    }
+    if(word != head && word != NULL && word->type != comb){
+        for(token* ptr = head; ptr != word; ptr = ptr->next){
+            command->envCount++;
+        }
+        command->env = arena_alloc(&line_arena, sizeof(char *) * command->envCount);
+        for(int i = 0; i < command->envCount; i++, head = head->next){
+            command->env[i] = expand_word(head);
+        }
+    }
+    command->type = head->type;
+    if(command->type == timed){
+        // time only means something in front of a pipeline, anywhere else it is a command
+        command->type = bare;
+    }
+    command->prev = NULL;
+    command->next = NULL;
+    command->input = NULL;
+    command->here = NULL;
+    command->hereLen = 0;
+    command->output = NULL;
+    command->arguments = NULL;
+    command->argCount = 0;
+    command->argCap = 0;
+    command->globStart = -1;
+    command->globEnd = -1;
+    command->globGap = 0;
+    command->source = head;
+    command->path_name = NULL;
+    token* ptr = head;
     switch(head->type){
         case cd:
         case pwd:
+        case set:
+        case hash:
+        case jobctl:
+        case timed:
+        case builtin:
+        case assign:
         case bare:
         case path:
         case term:
-            command->argCount = 0;
-            command->arguments = (char **) malloc(sizeof(char *));
             if(head->wildcard == 1){
-                find_wildcards(command, ptr->chrPtr, command->type);
+                long long start = trace_start();
+                add_words(command, ptr);
+                trace_end(PHASE_GLOB, start);
                 if(command->argCount > 1){
                     errno = 1;
                     perror("Too many potential files");
-                    free_command(command);
                     return NULL;
                 } else{
-                    command->path_name = malloc(sizeof(char) * (strlen(command->arguments[0]) + 1));
-                    memcpy(command->path_name, command->arguments[0], strlen(command->arguments[0]));
-                    command->path_name[strlen(command->arguments[0])] = '\0';
+                    command->path_name = command->arguments[0];
+                }
+            } else{
+                if(command->type == assign){
+                    add_argument(command, expand_word(ptr));
+                } else{
+                    add_words(command, ptr);
+                }
+                if(command->argCount == 0){
+                    errno = EINVAL;
+                    perror("No Command Given");
+                    return NULL;
+                }
+                if((command->type == bare || command->type == path) && memchr(ptr->chrPtr, '$', ptr->len) != NULL){
+                    // what the word expanded to decides whether it is looked up
+                    command->type = strchr(command->arguments[0], '/') != NULL ? path : bare;
+                }
+                if(command->type == bare){
+                    long long start = trace_start();
+                    command->path_name = find_executable(command->arguments[0]);
+                    trace_end(PHASE_LOOKUP, start);
+                    if(command->path_name == NULL){
+                        return NULL;
+                    }
+                } else{
+                    command->path_name = command->arguments[0];
+                }
+            }
+            ptr = ptr->next;
+            while(ptr != NULL){
+                if(ptr->type == in){
+                    ptr = ptr->next;
+                    if(ptr != NULL){
+                        if(ptr->type == in || ptr->type == out || ptr->type == comb){
+                            errno = 1;
+                            perror("Double Special Character Error");
+                            return NULL;
+                        } else if(ptr->wildcard == 1){
+                            errno = 1;
+                            perror("Input can't be redirected to a wildcard");
+                            return NULL;
+                        } else if(command->input == NULL && command->here == NULL){
+                            command->input = expand_word(ptr);
+                        } else{
+                            errno = 1;
+                            perror("Attempting Multiple Input Redirections");
+                            return NULL;
+                        }
+                    } else{
+                        errno = 5;
+                        perror("No Input Redirection Given");
+                        return NULL;
+                    }
+                } else if(ptr->type == heredoc || ptr->type == herestr){
+                    int string = ptr->type == herestr;
+                    ptr = ptr->next;
+                    if(ptr == NULL || ptr->type != here){
+                        errno = 5;
+                        perror("No Here-Document Given");
+                        return NULL;
+                    } else if(command->input != NULL || command->here != NULL){
+                        errno = 1;
+                        perror("Attempting Multiple Input Redirections");
+                        return NULL;
+                    }
+                    // a here-string is the word and a newline
+                    command->here = ptr->chrPtr;
+                    command->hereLen = ptr->len;
+                    if(string){
+                        char* word = expand_word(ptr);
+                        command->hereLen = strlen(word);
+                        command->here = arena_alloc(&line_arena, command->hereLen + 1);
+                        memcpy(command->here, word, command->hereLen);
+                        command->here[command->hereLen++] = '\n';
+                    }
+                } else if(ptr->type == out){
+                    ptr = ptr->next;
+                    if(ptr != NULL){
+                        if(ptr->type == in || ptr->type == out || ptr->type == comb){
+                            errno = 1;
+                            perror("Double Special Character Error");
+                            return NULL;
+                        } else if(ptr->wildcard == 1){
+                            errno = 1;
+                            perror("Output can't be redirected to a wildcard");
+                            return NULL;
+                        } else if(command->output == NULL){
+                            command->output = expand_word(ptr);
+                        } else{
+                            errno = 1;
+                            perror("Attempting Multiple Output Redirections");
+                            return NULL;
+                        }
+                    } else{
+                        errno = 5;
+                        perror("No Output Redirection Given");
+                        return NULL;
+                    }
+                } else if(ptr->type == comb){
+                    if(ptr->next == NULL){
+                        errno = 1;
+                        perror("No Command Given");
+                        return NULL;
+                    }
+                    command->next = process_tokens(ptr->next);
+                    if(command->next == NULL){
+                        return NULL;
+                    } else{
+                        command->next->prev = command;
+                        return command;
+                    }
+                } else{
+                    if(ptr->wildcard == 1){
+                        long long start = trace_start();
+                        add_words(command, ptr);
+                        trace_end(PHASE_GLOB, start);
+                    } else if(ptr->type == assign){
+                        add_argument(command, expand_word(ptr));
+                    } else{
+                        add_words(command, ptr);
+                    }
+                }
+                ptr = ptr->next;
+            }
+            return command;
+            break;
+        case in:
+        case heredoc:
+        case herestr:
+        case here:
+        case out:
+        case comb:
+        case amp:
+        case semi:
+        case andif:
+        case orif:
+            errno = 1;
+            perror("Command can't start with special character");
+            return NULL;
+            break;
+        case loop:
+        case body:
+            // a loop is only ever a whole pipeline, parse_list takes those out
+            errno = EINVAL;
+            perror("A loop can't be part of a pipeline");
+            return NULL;
+    }
+    return NULL;
+}
+
+// commands found on $PATH are remembered, misses included, so a script that
+// runs the same few tools over and over only searches the directories once
+typedef struct exec_entry_info exec_entry;
+
+struct exec_entry_info{
+    char* name;
+    char* path_name;
+    int hits;
+    exec_entry* next;
+};
+
+struct path_dir{
+    char* name;
+    int len;
+    struct timespec mtime;
+};
+
+#define EXEC_BUCKETS 256
+#define DEFAULT_PATH "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin"
+
+exec_entry* exec_table[EXEC_BUCKETS];
+struct path_dir* path_dirs;
+int num_path_dirs;
+char* cached_path;
+
+unsigned int hash_name(const char* name){
+    unsigned int h = 2166136261u;
+    while(*name != '\0'){
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    }
+    return h;
+}
+
+void exec_cache_clear(void){
+    for(int i = 0; i < EXEC_BUCKETS; i++){
+        exec_entry* ptr = exec_table[i];
+        while(ptr != NULL){
+            exec_entry* temp = ptr;
+            ptr = ptr->next;
+            free(temp->name);
+            free(temp->path_name);
+            free(temp);
+        }
+        exec_table[i] = NULL;
+    }
+}
+
+// record the directories' mtimes so we can tell when a miss may have become a hit
+void stat_path_dirs(void){
+    struct stat buf;
+    for(int i = 0; i < num_path_dirs; i++){
+        if(stat(path_dirs[i].name, &buf) == 0){
+            path_dirs[i].mtime = buf.st_mtim;
+        } else{
+            path_dirs[i].mtime.tv_sec = 0;
+            path_dirs[i].mtime.tv_nsec = 0;
+        }
+    }
+}
+
+// returns 1 if any directory on the path changed since it was last looked at
+int path_dirs_changed(void){
+    struct stat buf;
+    int changed = 0;
+    for(int i = 0; i < num_path_dirs; i++){
+        struct timespec mtime = {0, 0};
+        if(stat(path_dirs[i].name, &buf) == 0){
+            mtime = buf.st_mtim;
+        }
+        if(mtime.tv_sec != path_dirs[i].mtime.tv_sec || mtime.tv_nsec != path_dirs[i].mtime.tv_nsec){
+            path_dirs[i].mtime = mtime;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// rebuild the directory list whenever $PATH is different from the one the table was built for
+void exec_cache_sync(void){
+    char* path = getenv("PATH");
+    if(path == NULL){
+        path = DEFAULT_PATH;
+    }
+    if(cached_path != NULL && strcmp(cached_path, path) == 0){
+        return;
+    }
+    exec_cache_clear();
+    for(int i = 0; i < num_path_dirs; i++){
+        free(path_dirs[i].name);
+    }
+    free(path_dirs);
+    free(cached_path);
+    cached_path = strdup(path);
+    num_path_dirs = 0;
+    path_dirs = malloc(sizeof(struct path_dir) * (strlen(path) + 1));
+    char* start = path;
+    while(1){
+        char* end = strchr(start, ':');
+        int len = end == NULL ? strlen(start) : end - start;
+        // an empty entry means the current directory
+        char* name = malloc(sizeof(char) * (len + 3));
+        if(len == 0){
+            strcpy(name, "./");
+            len = 2;
+        } else{
+            memcpy(name, start, len);
+            if(name[len-1] != '/'){
+                name[len++] = '/';
+            }
+            name[len] = '\0';
+        }
+        path_dirs[num_path_dirs].name = name;
+        path_dirs[num_path_dirs].len = len;
+        num_path_dirs++;
+        if(end == NULL){
+            break;
+        }
+        start = end + 1;
+    }
+    stat_path_dirs();
+}
+
+exec_entry* exec_cache_lookup(char* name){
+    exec_entry* ptr = exec_table[hash_name(name) % EXEC_BUCKETS];
+    while(ptr != NULL && strcmp(ptr->name, name) != 0){
+        ptr = ptr->next;
+    }
+    return ptr;
+}
+
+void exec_cache_forget(char* name){
+    exec_entry** link = &exec_table[hash_name(name) % EXEC_BUCKETS];
+    while(*link != NULL){
+        if(strcmp((*link)->name, name) == 0){
+            exec_entry* temp = *link;
+            *link = temp->next;
+            free(temp->name);
+            free(temp->path_name);
+            free(temp);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+// walks the path directories, the only place that stats candidate files
+exec_entry* search_path(char* chr){
+    struct stat buf;
+    int strLength = strlen(chr);
+    int not_executable = 0;
+    exec_entry* entry = malloc(sizeof(exec_entry));
+    entry->name = strdup(chr);
+    entry->path_name = NULL;
+    entry->hits = 0;
+    for(int i = 0; i < num_path_dirs; i++){
+        char* temp = (char*) malloc(sizeof(char) * (path_dirs[i].len + strLength + 1));
+        memcpy(temp, path_dirs[i].name, path_dirs[i].len);
+        memcpy(temp + path_dirs[i].len, chr, strLength + 1);
+        if(stat(temp, &buf) == 0 && S_ISREG(buf.st_mode)){
+            if(buf.st_mode & (S_IXUSR|S_IXGRP|S_IXOTH)){
+                entry->path_name = temp;
+                break;
+            }
+            not_executable = 1;
+        }
+        free(temp);
+    }
+    unsigned int bucket = hash_name(chr) % EXEC_BUCKETS;
+    entry->next = exec_table[bucket];
+    exec_table[bucket] = entry;
+    if(entry->path_name == NULL){
+        errno = not_executable ? EACCES : ENOENT;
+    }
+    return entry;
+}
+
+char* find_executable(char *chr){
+    exec_cache_sync();
+    exec_entry* entry = exec_cache_lookup(chr);
+    if(entry != NULL && entry->path_name == NULL && path_dirs_changed()){
+        // something was added to the path since the miss was recorded
+        exec_cache_clear();
+        entry = NULL;
+    }
+    if(entry == NULL){
+        entry = search_path(chr);
+    } else if(entry->path_name == NULL){
+        errno = ENOENT;
+    }
+    if(entry->path_name == NULL){
+        perror(chr);
+        return NULL;
+    }
+    entry->hits++;
+    return arena_strndup(&line_arena, entry->path_name, strlen(entry->path_name));
+}
+
+uint64_t hash_bytes(const char* data, size_t len, uint64_t h){
+    for(size_t i = 0; i < len; i++){
+        h = (h ^ (unsigned char) data[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+#define HASH_SEED 14695981039346656037ull
+
+// the cache for a script is named after a hash of its absolute path
+char* cache_file_name(const char* script, const char* dir){
+    char* real = realpath(script, NULL);
+    if(real == NULL){
+        return NULL;
+    }
+    char* name = malloc(strlen(dir) + 32);
+    if(name == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(name, "%s/%016llx.myshc", dir, (unsigned long long) hash_bytes(real, strlen(real), HASH_SEED));
+    free(real);
+    return name;
+}
+
+// maps the compiled form of a script, compiling it first when there is none
+// or the one there was made from different contents or a different $HOME
+int open_script_cache(script_cache* cache, line_source* src, const char* script, const char* dir){
+    struct stat buf;
+    if(fstat(src->fd, &buf) == -1){
+        return -1;
+    }
+    char* name = cache_file_name(script, dir);
+    if(name == NULL){
+        return -1;
+    }
+    uint64_t hash = hash_bytes(src->map, src->mapLen, HASH_SEED);
+    int fd = open(name, O_RDONLY|O_CLOEXEC);
+    if(fd >= 0 && load_script_cache(cache, fd, &buf, hash) == 0){
+        close(fd);
+        free(name);
+        return 0;
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+    // written under a temporary name and renamed, so a concurrent run never maps half a file
+    char* temp = malloc(strlen(name) + 16);
+    if(temp == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(temp, "%s.%d", name, (int) getpid());
+    fd = open(temp, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, 0644);
+    if(fd == -1){
+        perror(temp);
+        free(temp);
+        free(name);
+        return -1;
+    }
+    int failed = compile_script(src, fd, temp, &buf, hash) == -1 || rename(temp, name) == -1;
+    if(failed){
+        unlink(temp);
+    }
+    close(fd);
+    free(temp);
+    fd = failed ? -1 : open(name, O_RDONLY|O_CLOEXEC);
+    free(name);
+    if(fd == -1 || load_script_cache(cache, fd, &buf, hash) == -1){
+        if(fd >= 0){close(fd);}
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// maps a cache file and checks it belongs to this version of the script,
+// and that every record in it points inside the file
+int load_script_cache(script_cache* cache, int fd, struct stat* script, uint64_t hash){
+    struct stat buf;
+    if(fstat(fd, &buf) == -1 || (size_t) buf.st_size < sizeof(cache_header)){
+        return -1;
+    }
+    char* map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED){
+        return -1;
+    }
+    cache_header* header = (cache_header*) map;
+    char* path = getenv("PATH");
+    size_t need = sizeof(cache_header) + header->dirs * sizeof(cached_dir) + header->lines * sizeof(cached_line)
+        + header->tokens * sizeof(cached_token) + header->execs * sizeof(cached_exec) + header->stringsLen;
+    if(memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || need != (size_t) buf.st_size
+        || header->size != (uint64_t) script->st_size || header->ino != (uint64_t) script->st_ino
+        || header->dev != (uint64_t) script->st_dev || header->mtimeSec != script->st_mtim.tv_sec
+        || header->mtimeNsec != script->st_mtim.tv_nsec || header->hash != hash){
+        munmap(map, buf.st_size);
+        return -1;
+    }
+    cache->map = map;
+    cache->mapLen = buf.st_size;
+    cache->header = header;
+    // ordered by alignment, widest first
+    cache->dirs = (cached_dir*) (map + sizeof(cache_header));
+    cache->lines = (cached_line*) (cache->dirs + header->dirs);
+    cache->tokens = (cached_token*) (cache->lines + header->lines);
+    cache->execs = (cached_exec*) (cache->tokens + header->tokens);
+    cache->strings = (char*) (cache->execs + header->execs);
+    int valid = 1;
+    for(uint32_t i = 0; i < header->lines && valid; i++){
+        cached_line* line = &cache->lines[i];
+        valid = line->first <= header->tokens && line->count <= header->tokens - line->first
+            && (uint64_t) line->textOffset + line->textLen <= header->size;
+    }
+    for(uint32_t i = 0; i < header->tokens && valid; i++){
+        cached_token* tok = &cache->tokens[i];
+        valid = (uint64_t) tok->offset + tok->len <= header->stringsLen && tok->type <= term;
+    }
+    for(uint32_t i = 0; i < header->execs && valid; i++){
+        valid = cache->execs[i].name < header->stringsLen && cache->execs[i].path < header->stringsLen;
+    }
+    if(!valid || (header->stringsLen > 0 && cache->strings[header->stringsLen - 1] != '\0')){
+        munmap(map, buf.st_size);
+        return -1;
+    }
+    // the commands found last time are only trusted if no PATH directory changed since
+    if(header->pathHash == hash_bytes(path == NULL ? DEFAULT_PATH : path, strlen(path == NULL ? DEFAULT_PATH : path), HASH_SEED)){
+        seed_exec_cache(cache);
+    }
+    return 0;
+}
+
+void seed_exec_cache(script_cache* cache){
+    exec_cache_sync();
+    if((uint32_t) num_path_dirs != cache->header->dirs){
+        return;
+    }
+    for(int i = 0; i < num_path_dirs; i++){
+        if(path_dirs[i].mtime.tv_sec != cache->dirs[i].sec || path_dirs[i].mtime.tv_nsec != cache->dirs[i].nsec){
+            return;
+        }
+    }
+    for(uint32_t i = 0; i < cache->header->execs; i++){
+        char* name = cache->strings + cache->execs[i].name;
+        if(exec_cache_lookup(name) != NULL){
+            continue;
+        }
+        exec_entry* entry = malloc(sizeof(exec_entry));
+        entry->name = strdup(name);
+        entry->path_name = strdup(cache->strings + cache->execs[i].path);
+        entry->hits = 0;
+        unsigned int bucket = hash_name(name) % EXEC_BUCKETS;
+        entry->next = exec_table[bucket];
+        exec_table[bucket] = entry;
+    }
+}
+
+size_t buffer_add(byte_buffer* buf, const void* data, size_t len){
+    if(len == 0){
+        return buf->len;
+    }
+    if(buf->len + len > buf->cap){
+        buf->cap = buf->cap == 0 ? 4096 : buf->cap;
+        while(buf->len + len > buf->cap){
+            buf->cap *= 2;
+        }
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return buf->len - len;
+}
+
+// tokenizes every line of the script and looks up every command it names
+// without running anything, and writes the result to fd, which is named file
+int compile_script(line_source* src, int fd, const char* file, struct stat* script, uint64_t hash){
+    byte_buffer lines = {0}, tokens = {0}, execs = {0}, strings = {0};
+    cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.size = script->st_size;
+    header.ino = script->st_ino;
+    header.dev = script->st_dev;
+    header.mtimeSec = script->st_mtim.tv_sec;
+    header.mtimeNsec = script->st_mtim.tv_nsec;
+    header.hash = hash;
+    exec_cache_sync();
+    header.pathHash = hash_bytes(cached_path, strlen(cached_path), HASH_SEED);
+    char* line;
+    int len;
+    while(next_unit(src, &line, &len)){
+        cached_line record = {header.tokens, 0, line - src->map, len};
+        int command = 1;
+        for(token* ptr = make_tokens(line, len); ptr != NULL; ptr = ptr->next){
+            cached_token tok = {strings.len, ptr->len, ptr->type, ptr->wildcard};
+            buffer_add(&strings, ptr->chrPtr, ptr->len);
+            buffer_add(&strings, "", 1);
+            buffer_add(&tokens, &tok, sizeof(tok));
+            header.tokens++;
+            record.count++;
+            // only commands that are there now are remembered, the rest are looked up when run
+            if(command && ptr->type == bare && !ptr->wildcard && memchr(ptr->chrPtr, '$', ptr->len) == NULL){
+                char* name = token_string(ptr);
+                exec_entry* entry = exec_cache_lookup(name);
+                if(entry == NULL){
+                    entry = search_path(name);
+                }
+                if(entry->path_name != NULL){
+                    cached_exec exec = {tok.offset, 0};
+                    exec.path = buffer_add(&strings, entry->path_name, strlen(entry->path_name) + 1);
+                    buffer_add(&execs, &exec, sizeof(exec));
+                    header.execs++;
+                }
+            }
+            command = command_follows(ptr, command);
+        }
+        buffer_add(&lines, &record, sizeof(record));
+        header.lines++;
+        arena_reset(&line_arena);
+    }
+    header.dirs = num_path_dirs;
+    header.stringsLen = strings.len;
+    // the script is run from the top again, from the cache this time
+    src->mapPos = 0;
+    int status = 0;
+    byte_buffer out = {0};
+    buffer_add(&out, &header, sizeof(header));
+    for(int i = 0; i < num_path_dirs; i++){
+        cached_dir dir = {path_dirs[i].mtime.tv_sec, path_dirs[i].mtime.tv_nsec};
+        buffer_add(&out, &dir, sizeof(dir));
+    }
+    buffer_add(&out, lines.data, lines.len);
+    buffer_add(&out, tokens.data, tokens.len);
+    buffer_add(&out, execs.data, execs.len);
+    buffer_add(&out, strings.data, strings.len);
+    for(size_t done = 0; status == 0 && done < out.len; ){
+        ssize_t n = write(fd, out.data + done, out.len - done);
+        if(n <= 0){
+            perror(file);
+            status = -1;
+            break;
+        }
+        done += n;
+    }
+    free(lines.data);
+    free(tokens.data);
+    free(execs.data);
+    free(strings.data);
+    free(out.data);
+    return status;
+}
+
+// rebuilds a line's tokens from the cache; their text stays in the mapped file
+token* cached_tokens(script_cache* cache, cached_line* line){
+    token* head = NULL;
+    token* tail = NULL;
+    for(uint32_t i = 0; i < line->count; i++){
+        cached_token* tok = &cache->tokens[line->first + i];
+        token* temp = arena_alloc(&line_arena, sizeof(token));
+        temp->type = tok->type;
+        temp->chrPtr = cache->strings + tok->offset;
+        temp->len = tok->len;
+        temp->wildcard = tok->wildcard;
+        temp->prev = tail;
+        temp->next = NULL;
+        if(tail == NULL){
+            head = temp;
+        } else{
+            tail->next = temp;
+        }
+        tail = temp;
+    }
+    return head;
+}
+
+// the main loop for a compiled script
+int run_cached(script_cache* cache, line_source* src){
+    int status = 0;
+    for(uint32_t i = 0; i < cache->header->lines; i++){
+        reap_jobs(0);
+        cached_line* line = &cache->lines[i];
+        trace_line_start = trace_start();
+        status = run_tokens(cached_tokens(cache, line), src->map + line->textOffset, line->textLen, status);
+        if(status == 2){
+            exit(EXIT_SUCCESS);
+        }
+    }
+    return status;
+}
+
+// mysh --serve socket: a daemon that runs scripts for clients. A request is the
+// script's length, sent with the client's stdin, stdout, stderr and working
+// directory attached, followed by the script; each request runs in a child of
+// the daemon, which writes to the client's descriptors directly and answers with
+// the status of the last line
+int serve(const char* path){
+    int sock = serve_socket(path);
+    if(sock == -1){
+        return EXIT_FAILURE;
+    }
+    exec_cache_sync();
+    // the daemon steps into a client's directory to read what its globs will list
+    int home = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    serve_request pending[SERVE_PENDING];
+    struct pollfd fds[SERVE_PENDING + 1];
+    int count = 0;
+    while(1){
+        while(waitpid(-1, NULL, WNOHANG) > 0);
+        fds[0].fd = sock;
+        fds[0].events = count < SERVE_PENDING ? POLLIN : 0;
+        for(int i = 0; i < count; i++){
+            fds[i + 1].fd = pending[i].conn;
+            fds[i + 1].events = POLLIN;
+        }
+        int ready = poll(fds, count + 1, count > 0 ? 1000 : -1);
+        if(ready == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        // from the back, so the request moved into a finished one's place was already seen
+        for(int i = count - 1; i >= 0; i--){
+            serve_request* r = &pending[i];
+            int result = 0;
+            if(fds[i + 1].revents != 0){
+                result = receive_request(r);
+            }
+            // a client that connects and says nothing can't hold a slot for long
+            if(result == 0 && now.tv_sec >= r->deadline){
+                result = -1;
+            }
+            if(result == 0){
+                continue;
+            }
+            if(result == 1){
+                line_source src;
+                open_source(&src, r->script);
+                warm_exec_cache(&src, r->fds[3], home);
+                pid_t pid = fork();
+                if(pid == 0){
+                    close(sock);
+                    // other clients' descriptors would keep their pipes open
+                    for(int k = 0; k < count; k++){
+                        if(k == i){
+                            continue;
+                        }
+                        close(pending[k].conn);
+                        if(pending[k].script != -1){
+                            close(pending[k].script);
+                            for(int f = 0; f < SERVE_FDS; f++){
+                                close(pending[k].fds[f]);
+                            }
+                        }
+                    }
+                    fcntl(r->conn, F_SETFL, 0);
+                    serve_client(r->conn, r->fds, &src);
+                }
+                if(pid == -1){
+                    perror("fork");
+                }
+                close_source(&src);
+            } else if(r->script != -1){
+                close(r->script);
+            }
+            if(r->script != -1){
+                for(int k = 0; k < SERVE_FDS; k++){
+                    close(r->fds[k]);
+                }
+            }
+            close(r->conn);
+            pending[i] = pending[--count];
+        }
+        if(fds[0].revents & POLLIN){
+            int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK);
+            if(conn == -1){
+                if(errno == EINTR || errno == ECONNABORTED || errno == EAGAIN){
+                    continue;
+                }
+                perror("accept");
+                break;
+            }
+            // scripts run as the daemon's user, so nobody else may send them
+            struct ucred cred;
+            socklen_t credLen = sizeof(cred);
+            if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == -1 || cred.uid != geteuid()){
+                close(conn);
+                continue;
+            }
+            pending[count].conn = conn;
+            pending[count].script = -1;
+            pending[count].left = 0;
+            pending[count].deadline = now.tv_sec + SERVE_TIMEOUT;
+            count++;
+        }
+    }
+    close(sock);
+    if(home != -1){
+        close(home);
+    }
+    return EXIT_FAILURE;
+}
+
+// binds the socket, taking over the path from a daemon that is gone
+// the socket is only open to the daemon's own user, whatever the umask
+int serve_socket(const char* path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        perror(path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if(sock == -1){
+        perror("socket");
+        return -1;
+    }
+    mode_t mask = umask(0077);
+    int bound = bind(sock, (struct sockaddr*) &addr, sizeof(addr));
+    if(bound == -1 && errno == EADDRINUSE){
+        int probe = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if(probe != -1 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == -1 && errno == ECONNREFUSED){
+            unlink(path);
+            bound = bind(sock, (struct sockaddr*) &addr, sizeof(addr));
+        } else{
+            errno = EADDRINUSE;
+        }
+        if(probe != -1){
+            close(probe);
+        }
+    }
+    umask(mask);
+    if(bound == -1 || listen(sock, SOMAXCONN) == -1){
+        perror(path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// takes the descriptors and copies the script into a memfd, which open_source
+// maps like any script file, as much as has arrived; returns 1 once the request
+// is complete, 0 while more is to come and -1 if it is broken
+int receive_request(serve_request* r){
+    if(r->script == -1){
+        uint32_t len;
+        union{
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int) * SERVE_FDS)];
+        } control;
+        struct iovec iov = {&len, sizeof(len)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t n = recvmsg(r->conn, &msg, MSG_CMSG_CLOEXEC);
+        if(n == -1 && (errno == EAGAIN || errno == EINTR)){
+            return 0;
+        }
+        struct cmsghdr* cmsg = n == -1 ? NULL : CMSG_FIRSTHDR(&msg);
+        int received = 0;
+        if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(r->fds, CMSG_DATA(cmsg), sizeof(int) * (received < SERVE_FDS ? received : SERVE_FDS));
+        }
+        // the client sends the length in one message, so a short one is a broken request
+        if(n == sizeof(len) && received == SERVE_FDS){
+            r->script = memfd_create("mysh-request", MFD_CLOEXEC);
+            r->left = len;
+        }
+        if(r->script == -1){
+            for(int i = 0; i < received && i < SERVE_FDS; i++){
+                close(r->fds[i]);
+            }
+            return -1;
+        }
+    }
+    char buffer[BUFSIZE];
+    while(r->left > 0){
+        ssize_t n = read(r->conn, buffer, r->left < BUFSIZE ? r->left : BUFSIZE);
+        if(n == -1 && (errno == EAGAIN || errno == EINTR)){
+            return 0;
+        }
+        if(n <= 0 || write_all(r->script, buffer, n) == -1){
+            return -1;
+        }
+        r->left -= n;
+    }
+    return 1;
+}
+
+// the daemon looks up a request's commands and lists the directories its globs
+// read itself before handing it to a child, from the client's directory cwd, so
+// what it finds stays cached for every request after it; it goes back to home after
+void warm_exec_cache(line_source* src, int cwd, int home){
+    char* line;
+    int len;
+    int moved = 0;
+    exec_cache_sync();
+    while(next_unit(src, &line, &len)){
+        int command = 1;
+        process words;
+        memset(&words, 0, sizeof(words));
+        words.globStart = -1;
+        words.globEnd = -1;
+        for(token* ptr = make_tokens(line, len); ptr != NULL; ptr = ptr->next){
+            int plain = memchr(ptr->chrPtr, '$', ptr->len) == NULL;
+            if(command && ptr->type == bare && !ptr->wildcard && plain){
+                char* name = token_string(ptr);
+                if(exec_cache_lookup(name) == NULL){
+                    search_path(name);
+                }
+            }
+            if(ptr->wildcard && plain && home != -1){
+                if(!moved){
+                    moved = fchdir(cwd) == 0;
+                }
+                if(moved){
+                    find_wildcards(&words, expand_word(ptr), NULL);
+                }
+            }
+            command = command_follows(ptr, command);
+        }
+        arena_reset(&line_arena);
+    }
+    if(moved && fchdir(home) == -1){
+        perror("cd");
+    }
+    src->mapPos = 0;
+}
+
+// runs in the child for one request and doesn't return
+void serve_client(int conn, int* fds, line_source* src){
+    for(int i = 0; i < 3; i++){
+        dup2(fds[i], i);
+    }
+    if(fchdir(fds[3]) == -1){
+        perror("cd");
+    }
+    for(int i = 0; i < SERVE_FDS; i++){
+        close(fds[i]);
+    }
+    char* line;
+    int len;
+    int status = 0;
+    while(next_unit(src, &line, &len)){
+        reap_jobs(0);
+        status = run_line(line, len, status);
+        if(status == 2){
+            status = 0;
+            break;
+        }
+    }
+    int32_t result = status;
+    write_all(conn, (char*) &result, sizeof(result));
+    exit(EXIT_SUCCESS);
+}
+
+// hash lists the remembered commands, hash -r forgets them all,
+// hash -d name forgets one and hash name looks it up now
+int run_hash(process* ptr, int in, int out){
+    exec_cache_sync();
+    if(ptr->argCount == 1){
+        for(int i = 0; i < EXEC_BUCKETS; i++){
+            for(exec_entry* entry = exec_table[i]; entry != NULL; entry = entry->next){
+                if(entry->path_name != NULL){
+                    dprintf(out, "%d\t%s\n", entry->hits, entry->path_name);
+                } else{
+                    dprintf(out, "-\t%s (not found)\n", entry->name);
+                }
+            }
+        }
+        return 0;
+    }
+    if(strcmp(ptr->arguments[1], "-r") == 0){
+        exec_cache_clear();
+        stat_path_dirs();
+        return 0;
+    }
+    int status = 0;
+    int forget = strcmp(ptr->arguments[1], "-d") == 0;
+    for(int i = forget ? 2 : 1; i < ptr->argCount; i++){
+        exec_cache_forget(ptr->arguments[i]);
+        if(!forget && search_path(ptr->arguments[i])->path_name == NULL){
+            perror(ptr->arguments[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+int check_executables(process* head){
+    process* ptr = head;
+    while(ptr != NULL){
+        builtin_info* b = ptr->type == builtin ? find_builtin(ptr->arguments[0], strlen(ptr->arguments[0])) : NULL;
+        if(b != NULL && b->accepts != NULL && !b->accepts(ptr)){
+            // options the builtin doesn't know go to the real program
+            ptr->type = bare;
+            ptr->path_name = find_executable(ptr->arguments[0]);
+            if(ptr->path_name == NULL){
+                return 1;
+            }
+        }
+        if(ptr->prev != NULL && (ptr->input != NULL || ptr->here != NULL)){
+            errno = 1; 
+            perror("Multiple input directions");
+            return 1;
+        }
+        if(ptr->next != NULL && ptr->output != NULL){
+            errno = 1; 
+            perror("Multiple output directions");
+            return 1;
+        }
+        ptr = ptr->next;
+    }
+    return 0;
+}
+
+// the shell waits for every stage before moving on, so cd and pwd can run inside the shell itself
+int run_cd(process* ptr){
+    if(ptr->argCount > 2){
+        errno = 7;
+        perror("Error with cd");
+        return 1;
+    }
+    else if (ptr->argCount < 2){
+        if(chdir(getenv("HOME")) == -1){
+            perror("Error with cd");
+            return 1;
+        }
+    }
+    else{
+        if(chdir(ptr->arguments[1]) == -1){
+            perror("Error with cd");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int run_pwd(process* ptr, int in, int out){
+    char* buffer = getcwd(NULL, 0);
+    if(buffer == NULL){
+        perror("pwd: couldn't get current working directory");
+        return 1;
+    }
+    int len = strlen(buffer);
+    buffer = realloc(buffer, sizeof(char) * (len + 2));
+    buffer[len] = '\n';
+    buffer[len+1] = '\0';
+    write(out, buffer, len + 1);
+    free(buffer);
+    return 0;
+}
+
+// set -o name turns an option on, set +o name turns it off and set -o alone lists them
+int run_set(process* ptr, int in, int out){
+    if(ptr->argCount == 1 || (ptr->argCount == 2 && strcmp(ptr->arguments[1], "-o") == 0)){
+        for(int i = 0; i < NUM_OPTIONS; i++){
+            dprintf(out, "%-12s%s\n", options[i].name, *options[i].flag ? "on" : "off");
+        }
+        return 0;
+    }
+    if(ptr->argCount != 3 || (strcmp(ptr->arguments[1], "-o") != 0 && strcmp(ptr->arguments[1], "+o") != 0)){
+        errno = EINVAL;
+        perror("set: usage: set [-o|+o] option");
+        return 1;
+    }
+    for(int i = 0; i < NUM_OPTIONS; i++){
+        if(strcmp(options[i].name, ptr->arguments[2]) == 0){
+            *options[i].flag = ptr->arguments[1][0] == '-';
+            return 0;
+        }
+    }
+    errno = EINVAL;
+    perror(ptr->arguments[2]);
+    return 1;
+}
+
+// export lists the exported variables, export NAME=value sets and exports one
+// and export NAME exports one that is already set
+int run_export(process* ptr, int in, int out){
+    if(ptr->argCount == 1){
+        for(char** env = environ; *env != NULL; env++){
+            dprintf(out, "export %s\n", *env);
+        }
+        return 0;
+    }
+    int status = 0;
+    for(int i = 1; i < ptr->argCount; i++){
+        char* arg = ptr->arguments[i];
+        int nameLen = var_name_length(arg, strlen(arg));
+        if(nameLen == 0 || (arg[nameLen] != '=' && arg[nameLen] != '\0')){
+            errno = EINVAL;
+            perror(arg);
+            status = 1;
+        } else if(arg[nameLen] == '='){
+            set_var(arg, 1);
+        } else{
+            var* v = find_var(arg, nameLen);
+            if(v != NULL && !v->exported){
+                v->exported = 1;
+                rebuild_envp();
+            }
+        }
+    }
+    return status;
+}
+
+int run_unset(process* ptr, int in, int out){
+    for(int i = 1; i < ptr->argCount; i++){
+        unset_var(ptr->arguments[i]);
+    }
+    return 0;
+}
+
+// how much of s is a variable name: a letter or _, then letters, digits and _
+int var_name_length(const char* s, int len){
+    int i = 0;
+    while(i < len && (s[i] == '_' || (s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z')
+        || (i > 0 && s[i] >= '0' && s[i] <= '9'))){
+        i++;
+    }
+    return i;
+}
+
+unsigned int var_hash(const char* name, int len){
+    unsigned int h = 2166136261u;
+    for(int i = 0; i < len; i++){
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return h % VAR_BUCKETS;
+}
+
+// the table starts out as the environment the shell was given
+void load_variables(void){
+    vars_loaded = 1;
+    for(char** env = environ; *env != NULL; env++){
+        char* eq = strchr(*env, '=');
+        if(eq == NULL || eq == *env){
+            continue;
+        }
+        var* v = malloc(sizeof(var));
+        v->entry = strdup(*env);
+        v->nameLen = eq - *env;
+        v->exported = 1;
+        unsigned int bucket = var_hash(*env, v->nameLen);
+        v->next = var_table[bucket];
+        var_table[bucket] = v;
+    }
+    rebuild_envp();
+}
+
+var* find_var(const char* name, int len){
+    if(!vars_loaded){
+        load_variables();
+    }
+    var* v = var_table[var_hash(name, len)];
+    while(v != NULL && (v->nameLen != len || memcmp(v->entry, name, len) != 0)){
+        v = v->next;
+    }
+    return v;
+}
+
+char* var_value(const char* name, int len){
+    var* v = find_var(name, len);
+    return v == NULL ? NULL : v->entry + len + 1;
+}
+
+// entry is NAME=value; an unchanged value costs a compare and nothing else
+void set_var(const char* entry, int export){
+    int nameLen = strchr(entry, '=') - entry;
+    var* v = find_var(entry, nameLen);
+    if(v != NULL && strcmp(v->entry, entry) == 0){
+        if(export && !v->exported){
+            v->exported = 1;
+            rebuild_envp();
+        }
+        return;
+    }
+    if(v == NULL){
+        v = malloc(sizeof(var));
+        v->entry = NULL;
+        v->nameLen = nameLen;
+        v->exported = 0;
+        unsigned int bucket = var_hash(entry, nameLen);
+        v->next = var_table[bucket];
+        var_table[bucket] = v;
+    }
+    char* old = v->entry;
+    v->entry = strdup(entry);
+    v->exported |= export;
+    if(v->exported){
+        rebuild_envp();
+    }
+    // environ no longer points at the old string
+    free(old);
+}
+
+void unset_var(const char* name){
+    int len = strlen(name);
+    find_var(name, len);
+    var** link = &var_table[var_hash(name, len)];
+    while(*link != NULL){
+        var* v = *link;
+        if(v->nameLen == len && memcmp(v->entry, name, len) == 0){
+            *link = v->next;
+            if(v->exported){
+                rebuild_envp();
+            }
+            free(v->entry);
+            free(v);
+            return;
+        }
+        link = &v->next;
+    }
+}
+
+// environ points at the exported entries themselves, nothing is copied
+void rebuild_envp(void){
+    int count = 0;
+    for(int i = 0; i < VAR_BUCKETS; i++){
+        for(var* v = var_table[i]; v != NULL; v = v->next){
+            count += v->exported;
+        }
+    }
+    char** envp = malloc(sizeof(char *) * (count + 1));
+    if(envp == NULL){
+        perror("environment");
+        exit(EXIT_FAILURE);
+    }
+    count = 0;
+    for(int i = 0; i < VAR_BUCKETS; i++){
+        for(var* v = var_table[i]; v != NULL; v = v->next){
+            if(v->exported){
+                envp[count++] = v->entry;
+            }
+        }
+    }
+    envp[count] = NULL;
+    free(shell_envp);
+    shell_envp = envp;
+    environ = envp;
+    envp_count = count;
+    // the room left for arguments depends on the environment
+    argLimit = 0;
+}
+
+// the environment for a command with NAME=value words in front of it: the shell's
+// entries with those put over them, built in the line arena for just this command
+char** process_envp(process* ptr){
+    if(!vars_loaded){
+        load_variables();
+    }
+    char** envp = arena_alloc(&line_arena, sizeof(char *) * (envp_count + ptr->envCount + 1));
+    memcpy(envp, environ, sizeof(char *) * envp_count);
+    int count = envp_count;
+    for(int i = 0; i < ptr->envCount; i++){
+        int nameLen = strchr(ptr->env[i], '=') - ptr->env[i] + 1;
+        int j = 0;
+        while(j < count && strncmp(envp[j], ptr->env[i], nameLen) != 0){
+            j++;
+        }
+        envp[j] = ptr->env[i];
+        count += j == count;
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+// a leading ~ is replaced with $HOME, $NAME, ${NAME} and $? with their values and
+// $(...) with its output; a variable that isn't set is empty and a $ that starts
+// none of them stays, and values are never globbed
+char* expand_word(token* tok){
+    return expand_text(tok, NULL, NULL);
+}
+
+// when split is given it gets a byte per byte of the result, set where the byte
+// came out of a $(...) and may be split at
+char* expand_text(token* tok, char** split, int* resultLen){
+    const char* s = tok->chrPtr;
+    int len = tok->len;
+    int tilde = s[0] == '~' && (len == 1 || s[1] == '/');
+    if(!tilde && memchr(s, '$', len) == NULL){
+        char* word = token_string(tok);
+        if(split != NULL){
+            *split = arena_alloc(&line_arena, len + 1);
+            memset(*split, 0, len);
+            *resultLen = len;
+        }
+        return word;
+    }
+    byte_buffer out = {0};
+    byte_buffer mask = {0};
+    int i = 0;
+    char* home = tilde ? var_value("HOME", 4) : NULL;
+    if(home != NULL){
+        expand_add(&out, &mask, home, strlen(home), 0);
+        i = 1;
+    }
+    while(i < len){
+        const char* dollar = memchr(s + i, '$', len - i);
+        int stop = dollar == NULL ? len : dollar - s;
+        expand_add(&out, &mask, s + i, stop - i, 0);
+        if(dollar == NULL){
+            break;
+        }
+        i = stop + 1;
+        if(i < len && s[i] == '('){
+            int end = substitution_end(s, i, len);
+            if(end != -1){
+                substitution* sub = find_substitution(dollar, end - stop);
+                expand_add(&out, &mask, sub->output, sub->outputLen, 1);
+                i = end;
+                continue;
+            }
+        }
+        int brace = i < len && s[i] == '{';
+        int start = i + brace;
+        int end = start < len && s[start] == '?' ? start + 1 : start + var_name_length(s + start, len - start);
+        if(end == start || (brace && (end == len || s[end] != '}'))){
+            expand_add(&out, &mask, "$", 1, 0);
+            continue;
+        }
+        if(s[start] == '?'){
+            char number[16];
+            expand_add(&out, &mask, number, snprintf(number, sizeof(number), "%d", last_status), 0);
+        } else{
+            char* value = var_value(s + start, end - start);
+            if(value != NULL){
+                expand_add(&out, &mask, value, strlen(value), 0);
+            }
+        }
+        i = end + brace;
+    }
+    char* word = arena_strndup(&line_arena, out.len == 0 ? "" : out.data, out.len);
+    if(split != NULL){
+        *split = arena_strndup(&line_arena, mask.len == 0 ? "" : mask.data, mask.len);
+        *resultLen = out.len;
+    }
+    free(out.data);
+    free(mask.data);
+    return word;
+}
+
+void expand_add(byte_buffer* out, byte_buffer* mask, const char* data, size_t len, int split){
+    buffer_add(out, data, len);
+    buffer_add(mask, data, len);
+    if(len > 0){
+        memset(mask->data + mask->len - len, split, len);
+    }
+}
+
+// the index just past the ) that closes the ( at open, or -1 when the line ends first
+int substitution_end(const char* s, int open, int len){
+    int depth = 0;
+    for(int i = open; i < len && s[i] != '\n'; i++){
+        if(s[i] == '('){
+            depth++;
+        } else if(s[i] == ')' && --depth == 0){
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+// like word_end, but a $(...) is part of the word up to its closing parenthesis,
+// blanks and operators inside it included
+int word_span(const char* line, int l, int r){
+    int end = word_end(line, l, r);
+    for(int i = l; i + 1 < end; i++){
+        if(line[i] != '$' || line[i + 1] != '('){
+            continue;
+        }
+        int close = substitution_end(line, i + 1, r);
+        if(close == -1){
+            break;
+        }
+        i = close - 1;
+        if(close > end){
+            end = word_end(line, close, r);
+        }
+    }
+    return end;
+}
+
+// starts every $(...) in the pipeline before reading any of them, so they run side
+// by side and the pipeline waits for the slowest instead of all of them in turn;
+// a here-document body is left alone, it isn't expanded
+void run_substitutions(token* pipeline){
+    num_substitutions = 0;
+    for(int pass = 0; pass < 2; pass++){
+        int count = 0;
+        for(token* ptr = pipeline; ptr != NULL; ptr = ptr->next){
+            if(ptr->type == here && ptr->prev != NULL && ptr->prev->type == heredoc){
+                continue;
+            }
+            for(int i = 0; i + 1 < ptr->len; i++){
+                if(ptr->chrPtr[i] != '$' || ptr->chrPtr[i + 1] != '('){
+                    continue;
+                }
+                int close = substitution_end(ptr->chrPtr, i + 1, ptr->len);
+                if(close == -1){
+                    break;
+                }
+                if(pass == 1){
+                    substitution* sub = &substitutions[count];
+                    sub->start = ptr->chrPtr + i;
+                    sub->fd = -1;
+                    num_substitutions = count + 1;
+                    sub->pid = start_substitution(ptr->chrPtr + i + 2, close - i - 3, &sub->fd);
+                }
+                count++;
+                i = close - 1;
+            }
+        }
+        if(count == 0){
+            return;
+        }
+        if(pass == 0){
+            substitutions = arena_alloc(&line_arena, sizeof(substitution) * count);
+        }
+    }
+    read_substitutions(substitutions, num_substitutions);
+}
+
+// a subshell: a child that runs the text as a line of its own with its stdout going
+// into a pipe; the descriptor is the read end
+pid_t start_substitution(const char* text, int len, int* fd){
+    int p[2];
+    *fd = -1;
+    if(pipe2(p, O_CLOEXEC) == -1){
+        perror("Error with pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == -1){
+        perror("Error with fork");
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    if(pid == 0){
+        // the other substitutions' pipes would keep their readers from seeing the end
+        close(p[0]);
+        for(int i = 0; i < num_substitutions; i++){
+            if(substitutions[i].fd >= 0){
+                close(substitutions[i].fd);
+            }
+        }
+        dup2(p[1], STDOUT_FILENO);
+        close(p[1]);
+        if(job_control){
+            job_control = 0;
+            reset_signals();
+        }
+        interactive_shell = 0;
+        char* line = arena_strndup(&line_arena, text, len);
+        int status = run_line(line, len, last_status);
+        fflush(NULL);
+        _exit(status == 1);
+    }
+    close(p[1]);
+    *fd = p[0];
+    return pid;
+}
+
+// reads every substitution's pipe as data arrives, then reaps the children;
+// the trailing newlines of each output are dropped
+void read_substitutions(substitution* subs, int count){
+    struct pollfd* fds = arena_alloc(&line_arena, sizeof(struct pollfd) * count);
+    byte_buffer* outputs = arena_alloc(&line_arena, sizeof(byte_buffer) * count);
+    int pending = 0;
+    for(int i = 0; i < count; i++){
+        fds[i].fd = subs[i].fd;
+        fds[i].events = POLLIN;
+        outputs[i] = (byte_buffer) {0};
+        pending += subs[i].fd >= 0;
+    }
+    char chunk[MOVE_CHUNK];
+    while(pending > 0){
+        if(poll(fds, count, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        for(int i = 0; i < count; i++){
+            if(fds[i].fd < 0 || fds[i].revents == 0){
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, chunk, sizeof(chunk));
+            if(n > 0){
+                buffer_add(&outputs[i], chunk, n);
+            } else if(n == 0 || errno != EINTR){
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                pending--;
+            }
+        }
+    }
+    for(int i = 0; i < count; i++){
+        if(fds[i].fd >= 0){
+            close(fds[i].fd);
+        }
+        subs[i].fd = -1;
+        int status;
+        while(subs[i].pid > 0 && waitpid(subs[i].pid, &status, 0) == -1 && errno == EINTR);
+        size_t len = outputs[i].len;
+        while(len > 0 && outputs[i].data[len - 1] == '\n'){
+            len--;
+        }
+        subs[i].output = arena_strndup(&line_arena, len == 0 ? "" : outputs[i].data, len);
+        subs[i].outputLen = len;
+        free(outputs[i].data);
+    }
+}
+
+// the output of the $(...) starting at start, run now if run_substitutions didn't see it
+substitution* find_substitution(const char* start, int len){
+    for(int i = 0; i < num_substitutions; i++){
+        if(substitutions[i].start == start){
+            return &substitutions[i];
+        }
+    }
+    substitution* sub = arena_alloc(&line_arena, sizeof(substitution));
+    sub->start = start;
+    sub->pid = start_substitution(start + 2, len - 3, &sub->fd);
+    read_substitutions(sub, 1);
+    return sub;
+}
+
+// adds the word as arguments: what came out of a $(...) is split at blanks and the
+// rest of the word stays whole, and a word that expands to nothing adds nothing
+// the wildcards written in the word are then expanded, while the ones a $(...)
+// printed are matched as plain characters
+void add_words(process* command, token* tok){
+    char* split;
+    int len;
+    char* text = expand_text(tok, &split, &len);
+    int i = 0;
+    while(i < len){
+        while(i < len && split[i] && char_class[(unsigned char) text[i]] == CH_BLANK){
+            i++;
+        }
+        if(i == len){
+            break;
+        }
+        int start = i;
+        while(i < len && !(split[i] && char_class[(unsigned char) text[i]] == CH_BLANK)){
+            i++;
+        }
+        char* word = start == 0 && i == len ? text : arena_strndup(&line_arena, text + start, i - start);
+        if(tok->wildcard && has_wildcard(word, split + start, i - start)){
+            find_wildcards(command, word, split + start);
+        } else{
+            add_argument(command, word);
+        }
+    }
+}
+
+unsigned int builtin_hash(const char* name, int len){
+    unsigned char first = name[0];
+    unsigned char second = len > 1 ? name[1] : 0;
+    return (7 * first + 6 * second + 4 * len) & (BUILTIN_SLOTS - 1);
+}
+
+builtin_info* find_builtin(const char* name, int len){
+    if(len == 0){
+        return NULL;
+    }
+    builtin_info* b = &builtin_table[builtin_hash(name, len)];
+    if(b->name == NULL || b->len != len || memcmp(b->name, name, len) != 0){
+        return NULL;
+    }
+    return b;
+}
+
+int write_all(int fd, const char* buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// echo [-n] words: the words separated by spaces, and a newline unless -n
+int run_echo(process* ptr, int in, int out){
+    int first = 1;
+    int newline = 1;
+    if(ptr->argCount > 1 && strcmp(ptr->arguments[1], "-n") == 0){
+        newline = 0;
+        first = 2;
+    }
+    size_t len = 1;
+    for(int i = first; i < ptr->argCount; i++){
+        len += strlen(ptr->arguments[i]) + 1;
+    }
+    char* buffer = arena_alloc(&line_arena, len);
+    size_t pos = 0;
+    for(int i = first; i < ptr->argCount; i++){
+        if(i > first){
+            buffer[pos++] = ' ';
+        }
+        size_t word = strlen(ptr->arguments[i]);
+        memcpy(buffer + pos, ptr->arguments[i], word);
+        pos += word;
+    }
+    if(newline){
+        buffer[pos++] = '\n';
+    }
+    if(write_all(out, buffer, pos) == -1){
+        // like cat, a reader that went away isn't worth a message
+        if(errno != EPIPE){
+            perror("echo");
+        }
+        return 1;
+    }
+    return 0;
+}
+
+int run_true(process* ptr, int in, int out){
+    return 0;
+}
+
+int run_false(process* ptr, int in, int out){
+    return 1;
+}
+
+// test and [ take the POSIX forms by argument count: a string, a unary file or
+// string test, or a binary comparison, each optionally behind a !
+int run_test(process* ptr, int in, int out){
+    char** argv = ptr->arguments + 1;
+    int argc = ptr->argCount - 1;
+    if(strcmp(ptr->arguments[0], "[") == 0){
+        if(argc == 0 || strcmp(argv[argc - 1], "]") != 0){
+            errno = EINVAL;
+            perror("[: missing ]");
+            return 1;
+        }
+        argc--;
+    }
+    int negate = 0;
+    if(argc > 1 && argc < 5 && strcmp(argv[0], "!") == 0){
+        negate = 1;
+        argv++;
+        argc--;
+    }
+    int result;
+    if(argc == 0){
+        result = 0;
+    } else if(argc == 1){
+        result = argv[0][0] != '\0';
+    } else if(argc == 2){
+        result = test_unary(argv[0], argv[1]);
+    } else if(argc == 3){
+        result = test_binary(argv[0], argv[1], argv[2]);
+    } else{
+        errno = E2BIG;
+        perror("test");
+        return 1;
+    }
+    if(result == -1){
+        return 1;
+    }
+    return !(result ^ negate);
+}
+
+int test_unary(const char* op, const char* arg){
+    struct stat buf;
+    if(strcmp(op, "-n") == 0){
+        return arg[0] != '\0';
+    } else if(strcmp(op, "-z") == 0){
+        return arg[0] == '\0';
+    } else if(strcmp(op, "-r") == 0){
+        return access(arg, R_OK) == 0;
+    } else if(strcmp(op, "-w") == 0){
+        return access(arg, W_OK) == 0;
+    } else if(strcmp(op, "-x") == 0){
+        return access(arg, X_OK) == 0;
+    } else if(strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0){
+        return lstat(arg, &buf) == 0 && S_ISLNK(buf.st_mode);
+    }
+    if(strlen(op) != 2 || op[0] != '-' || strchr("efdsp", op[1]) == NULL){
+        errno = EINVAL;
+        perror(op);
+        return -1;
+    }
+    if(stat(arg, &buf) == -1){
+        return 0;
+    }
+    switch(op[1]){
+        case 'f':
+            return S_ISREG(buf.st_mode);
+        case 'd':
+            return S_ISDIR(buf.st_mode);
+        case 's':
+            return buf.st_size > 0;
+        case 'p':
+            return S_ISFIFO(buf.st_mode);
+        default:
+            return 1;
+    }
+}
+
+int test_binary(const char* left, const char* op, const char* right){
+    if(strcmp(op, "=") == 0){
+        return strcmp(left, right) == 0;
+    } else if(strcmp(op, "!=") == 0){
+        return strcmp(left, right) != 0;
+    }
+    const char* ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    int which = 0;
+    while(which < 6 && strcmp(op, ops[which]) != 0){
+        which++;
+    }
+    if(which == 6){
+        errno = EINVAL;
+        perror(op);
+        return -1;
+    }
+    long long a, b;
+    if(test_number(left, &a) == -1 || test_number(right, &b) == -1){
+        return -1;
+    }
+    switch(which){
+        case 0: return a == b;
+        case 1: return a != b;
+        case 2: return a < b;
+        case 3: return a <= b;
+        case 4: return a > b;
+        default: return a >= b;
+    }
+}
+
+int test_number(const char* str, long long* value){
+    char* end;
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    if(end == str || *end != '\0' || errno != 0){
+        errno = EINVAL;
+        perror(str);
+        return -1;
+    }
+    return 0;
+}
+
+// printf format [arguments]: backslash escapes and the %d %i %o %u %x %X %c %s
+// conversions with flags, width and precision; the format is reused until the
+// arguments run out, and missing ones read as empty or zero
+int run_printf(process* ptr, int in, int out){
+    if(ptr->argCount < 2){
+        errno = EINVAL;
+        perror("printf: usage: printf format [arguments]");
+        return 1;
+    }
+    char* text = NULL;
+    size_t size = 0;
+    FILE* buffer = open_memstream(&text, &size);
+    int next = 2;
+    int status = 0;
+    do{
+        int used = next;
+        for(const char* fmt = ptr->arguments[1]; *fmt != '\0' && status == 0; ){
+            if(*fmt == '\\'){
+                printf_escape(buffer, &fmt);
+                continue;
+            }
+            if(*fmt != '%'){
+                fputc(*fmt++, buffer);
+                continue;
+            }
+            if(fmt[1] == '%'){
+                fputc('%', buffer);
+                fmt += 2;
+                continue;
+            }
+            // each conversion gets a format of its own, widened to long long for the integers
+            char spec[32];
+            int len = 0;
+            spec[len++] = *fmt++;
+            while(*fmt != '\0' && strchr("-+ #0123456789.", *fmt) != NULL && len < 24){
+                spec[len++] = *fmt++;
+            }
+            char conv = *fmt;
+            if(conv == '\0' || strchr("diouxXcs", conv) == NULL){
+                errno = EINVAL;
+                perror("printf: bad conversion");
+                status = 1;
+                break;
+            }
+            fmt++;
+            const char* arg = next < ptr->argCount ? ptr->arguments[next++] : "";
+            if(conv == 's' || conv == 'c'){
+                spec[len++] = 's';
+                spec[len] = '\0';
+                char first[2] = {arg[0], '\0'};
+                fprintf(buffer, spec, conv == 'c' ? first : arg);
+                continue;
+            }
+            long long value = 0;
+            if(arg[0] == '\'' || arg[0] == '"'){
+                value = (unsigned char) arg[1];
+            } else if(arg[0] != '\0'){
+                char* end;
+                value = strtoll(arg, &end, 0);
+                if(*end != '\0'){
+                    errno = EINVAL;
+                    perror(arg);
+                    status = 1;
                 }
-            } else{
-                command->arguments[0] = (char *) malloc(sizeof(char) * (strlen(ptr->chrPtr) + 1));
-                strcpy(command->arguments[0], ptr->chrPtr);
-                command->argCount++;
-                if(command->type == bare){
-                    command->path_name = find_executable(command->arguments[0]);
-                    if(command->path_name == NULL){
-                        free_command(command);
-                        return NULL;
-                    }
-                } else{
-                    command->path_name = malloc(sizeof(char) * (strlen(ptr->chrPtr) + 1));
-                    strcpy(command->path_name, ptr->chrPtr);
+            }
+            spec[len++] = 'l';
+            spec[len++] = 'l';
+            spec[len++] = conv;
+            spec[len] = '\0';
+            fprintf(buffer, spec, value);
+        }
+        if(next == used){
+            break;
+        }
+    } while(next < ptr->argCount && status == 0);
+    fclose(buffer);
+    if(write_all(out, text, size) == -1){
+        if(errno != EPIPE){
+            perror("printf");
+        }
+        status = 1;
+    }
+    free(text);
+    return status;
+}
+
+// writes the character the escape at *fmt stands for and moves past it
+void printf_escape(FILE* buffer, const char** fmt){
+    const char* from = "abfnrtv\\\"";
+    const char* to = "\a\b\f\n\r\t\v\\\"";
+    const char* p = *fmt + 1;
+    const char* found = *p != '\0' ? strchr(from, *p) : NULL;
+    if(found != NULL){
+        fputc(to[found - from], buffer);
+        *fmt = p + 1;
+    } else if(*p == '0'){
+        int value = 0;
+        int digits = 0;
+        for(p++; digits < 3 && *p >= '0' && *p <= '7'; p++, digits++){
+            value = value * 8 + (*p - '0');
+        }
+        fputc(value, buffer);
+        *fmt = p;
+    } else{
+        // not an escape we know, so the backslash is kept
+        fputc('\\', buffer);
+        *fmt = p;
+    }
+}
+
+// moves everything left in one descriptor to another without it passing through
+// user space: copy_file_range between regular files, splice when either end is a
+// pipe and sendfile from a file, falling back a step whenever the kernel refuses
+int move_data(int in, int out){
+    struct stat in_buf, out_buf;
+    if(fstat(in, &in_buf) == -1 || fstat(out, &out_buf) == -1){
+        return -1;
+    }
+    int method = MOVE_RW;
+    if(S_ISREG(in_buf.st_mode) && S_ISREG(out_buf.st_mode)){
+        method = MOVE_COPY_RANGE;
+    } else if(S_ISFIFO(in_buf.st_mode) || S_ISFIFO(out_buf.st_mode)){
+        method = MOVE_SPLICE;
+    } else if(S_ISREG(in_buf.st_mode)){
+        method = MOVE_SENDFILE;
+    }
+    char buffer[MOVE_CHUNK];
+    while(1){
+        ssize_t n;
+        if(method == MOVE_COPY_RANGE){
+            n = copy_file_range(in, NULL, out, NULL, MOVE_CHUNK, 0);
+        } else if(method == MOVE_SPLICE){
+            n = splice(in, NULL, out, NULL, MOVE_CHUNK, SPLICE_F_MOVE);
+        } else if(method == MOVE_SENDFILE){
+            n = sendfile(out, in, NULL, MOVE_CHUNK);
+        } else{
+            n = read(in, buffer, MOVE_CHUNK);
+            if(n > 0 && write_all(out, buffer, n) == -1){
+                return -1;
+            }
+        }
+        if(n == 0){
+            return 0;
+        }
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            // every method moves from the current offsets, so the next one can take over anywhere
+            int unsupported = errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP
+                || (method == MOVE_COPY_RANGE && errno == EBADF);
+            if(method == MOVE_RW || !unsupported){
+                return -1;
+            }
+            method = method != MOVE_SENDFILE && S_ISREG(in_buf.st_mode) ? MOVE_SENDFILE : MOVE_RW;
+        }
+    }
+}
+
+// cat, tee and cp leave anything with options to the real programs
+int plain_arguments(process* ptr){
+    for(int i = 1; i < ptr->argCount; i++){
+        if(ptr->arguments[i][0] == '-' && ptr->arguments[i][1] != '\0'){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int cp_arguments(process* ptr){
+    return ptr->argCount == 3 && plain_arguments(ptr);
+}
+
+// cat [file...]: the files one after another, or the input for none of them or "-"
+int run_cat(process* ptr, int in, int out){
+    int status = 0;
+    for(int i = 1; i < ptr->argCount || (i == 1 && ptr->argCount == 1); i++){
+        char* name = ptr->argCount == 1 ? "-" : ptr->arguments[i];
+        int fd = strcmp(name, "-") == 0 ? in : open(name, O_RDONLY|O_CLOEXEC);
+        if(fd < 0){
+            perror(name);
+            status = 1;
+            continue;
+        }
+        int moved = move_data(fd, out);
+        int err = errno;
+        if(fd != in){
+            close(fd);
+        }
+        if(moved == -1){
+            // a reader that went away is a reason to stop, not to complain
+            if(err == EPIPE){
+                return 1;
+            }
+            errno = err;
+            perror(name);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// tee [file...]: the input goes to every file and to the output
+// from a pipe, tee(2) copies each chunk into a scratch pipe per file and splice
+// drains those, while the input itself is spliced to the output, so nothing is copied
+int run_tee(process* ptr, int in, int out){
+    int count = ptr->argCount;
+    int* fds = arena_alloc(&line_arena, sizeof(int) * count);
+    int status = 0;
+    int outputs = 0;
+    for(int i = 1; i < count; i++){
+        int fd = open(ptr->arguments[i], O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0666);
+        if(fd < 0){
+            perror(ptr->arguments[i]);
+            status = 1;
+            continue;
+        }
+        fds[outputs++] = fd;
+    }
+    // the output goes last, it is the one that takes the data out of the input
+    fds[outputs++] = out;
+    struct stat buf;
+    int scratch[2] = {-1, -1};
+    int piped = outputs == 1 || (fstat(in, &buf) == 0 && S_ISFIFO(buf.st_mode) && pipe2(scratch, O_CLOEXEC) == 0);
+    if(outputs == 1){
+        if(move_data(in, out) == -1 && errno != EPIPE){
+            perror("tee");
+            status = 1;
+        }
+    }
+    char buffer[MOVE_CHUNK];
+    while(outputs > 1){
+        ssize_t n;
+        if(piped){
+            n = tee(in, scratch[1], MOVE_CHUNK, 0);
+            if(n == -1 && errno == EINVAL){
+                piped = 0;
+                continue;
+            }
+        } else{
+            n = read(in, buffer, MOVE_CHUNK);
+        }
+        if(n <= 0){
+            if(n == -1 && errno == EINTR){
+                continue;
+            }
+            if(n == -1){
+                perror("tee");
+                status = 1;
+            }
+            break;
+        }
+        int failed = 0;
+        for(int i = 0; i < outputs && !failed; i++){
+            if(!piped){
+                failed = write_all(fds[i], buffer, n) == -1;
+                continue;
+            }
+            // each file gets a copy of the chunk, the output gets the chunk itself
+            if(i > 0 && i < outputs - 1 && tee(in, scratch[1], n, 0) != n){
+                failed = 1;
+                break;
+            }
+            int from = i == outputs - 1 ? in : scratch[0];
+            for(ssize_t left = n; left > 0 && !failed; ){
+                ssize_t moved = splice(from, NULL, fds[i], NULL, left, SPLICE_F_MOVE);
+                if(moved == -1 && errno == EINTR){
+                    continue;
+                }
+                if(moved <= 0){
+                    failed = 1;
+                    break;
                 }
+                left -= moved;
             }
-            ptr = ptr->next;
-            while(ptr != NULL){
-                if(ptr->type == in){
-                    ptr = ptr->next;
-                    if(ptr != NULL){
-                        if(ptr->type == in || ptr->type == out || ptr->type == comb){
-                            free_command(command);
-                            errno = 1;
-                            perror("Double Special Character Error");
-                            return NULL;
-                        } else if(ptr->wildcard == 1){
-                            free_command(command);
-                            errno = 1;
-                            perror("Input can't be redirected to a wildcard");
-                            return NULL;
-                        } else if(command->input == NULL){
-                            command->input = malloc(sizeof(char) * (strlen(ptr->chrPtr) + 1));
-                            strcpy(command->input, ptr->chrPtr);
-                        } else{
-                            errno = 1;
-                            perror("Attempting Multiple Input Redirections");
-                            free_command(command);
-                            return NULL;
-                        }
-                    } else{
-                        errno = 5;
-                        perror("No Input Redirection Given");
-                        free_command(command);
-                        return NULL;
+        }
+        if(failed){
+            if(errno != EPIPE){
+                perror("tee");
+            }
+            status = 1;
+            break;
+        }
+    }
+    if(scratch[0] >= 0){
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    for(int i = 0; i < outputs - 1; i++){
+        close(fds[i]);
+    }
+    return status;
+}
+
+// cp source target, where a target directory gets a file of the same name
+// copy_file_range lets the filesystem share or copy the blocks itself
+int run_cp(process* ptr, int in, int out){
+    char* source = ptr->arguments[1];
+    char* target = ptr->arguments[2];
+    struct stat from, to;
+    int fd = open(source, O_RDONLY|O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &from) == -1){
+        perror(source);
+        if(fd >= 0){close(fd);}
+        return 1;
+    }
+    if(stat(target, &to) == 0 && S_ISDIR(to.st_mode)){
+        char* base = strrchr(source, '/');
+        base = base == NULL ? source : base + 1;
+        char* joined = arena_alloc(&line_arena, strlen(target) + strlen(base) + 2);
+        sprintf(joined, "%s/%s", target, base);
+        target = joined;
+    }
+    if(stat(target, &to) == 0 && to.st_dev == from.st_dev && to.st_ino == from.st_ino){
+        errno = EINVAL;
+        perror(target);
+        close(fd);
+        return 1;
+    }
+    int copy = open(target, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, from.st_mode & 0777);
+    if(copy < 0){
+        perror(target);
+        close(fd);
+        return 1;
+    }
+    int status = 0;
+    if(move_data(fd, copy) == -1){
+        perror(target);
+        status = 1;
+    }
+    close(fd);
+    close(copy);
+    return status;
+}
+
+// whether a builtin can run inside the shell at this point in the pipeline,
+// or needs a process of its own to run alongside the other stages
+int builtin_in_shell(process* ptr, builtin_info* b, int background, int deferring){
+    if(!b->streams){
+        return 1;
+    }
+    if(background || deferring || (b->streams == BUILTIN_DATA && job_control)){
+        return 0;
+    }
+    return ptr->prev == NULL || ptr->next == NULL || ptr->output != NULL;
+}
+
+// a here-document reaches its command through a pipe when the pipe can hold all
+// of it, so the write never blocks, and through a memfd when it can't
+int here_input(process* ptr){
+    int p[2];
+    if(pipe2(p, O_CLOEXEC) == -1){
+        perror("Error with pipe");
+        return -1;
+    }
+    if(fcntl(p[1], F_GETPIPE_SZ) >= ptr->hereLen){
+        int written = write_all(p[1], ptr->here, ptr->hereLen);
+        close(p[1]);
+        if(written == -1){
+            perror("here-document");
+            close(p[0]);
+            return -1;
+        }
+        return p[0];
+    }
+    close(p[0]);
+    close(p[1]);
+    int fd = memfd_create("mysh-heredoc", MFD_CLOEXEC);
+    if(fd == -1 || write_all(fd, ptr->here, ptr->hereLen) == -1 || lseek(fd, 0, SEEK_SET) == -1){
+        perror("here-document");
+        if(fd >= 0){close(fd);}
+        return -1;
+    }
+    return fd;
+}
+
+// builtins write to their output redirection, the pipe into the next stage or stdout
+int builtin_output(process* ptr, int pipe_out){
+    if(ptr->output != NULL){
+        int out = open(ptr->output, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0640);
+        if(out < 0){
+            perror(ptr->output);
+        }
+        return out;
+    }
+    if(pipe_out >= 0){
+        return pipe_out;
+    }
+    return STDOUT_FILENO;
+}
+
+// posix_spawn lets libc start the child with a shared address space, so the
+// shell's heap is never copied; MYSH_LAUNCH=fork keeps the old fork path around
+// every fd the shell opens is close-on-exec, so only the dup2'd ones reach the child
+// with job control the child joins *pgid, or starts a new group that *pgid is set to,
+// and a foreground child takes the terminal before it execs
+pid_t launch_process(process* ptr, int in, int out, pid_t* pgid, int foreground){
+    pid_t pid;
+    // a builtin that needs its own process is forked and runs without an exec
+    builtin_info* b = NULL;
+    if(ptr->type != bare && ptr->type != path){
+        b = find_builtin(ptr->arguments[0], strlen(ptr->arguments[0]));
+    }
+    char** envp = ptr->env == NULL ? environ : process_envp(ptr);
+    if(use_fork || b != NULL){
+        pid = fork();
+        if(pid == -1){
+            perror("Error with fork");
+        }
+        else if(pid == 0){
+            if(pgid != NULL){
+                setpgid(0, *pgid);
+                if(foreground && *pgid == 0){
+                    tcsetpgrp(STDIN_FILENO, getpid());
+                }
+            }
+            reset_signals();
+            if(in >= 0){dup2(in, STDIN_FILENO);}
+            if(out >= 0){dup2(out, STDOUT_FILENO);}
+            if(b != NULL){
+                // nothing is exec'd, so close-on-exec won't shut the shell's other pipe ends
+                syscall(SYS_close_range, 3, ~0U, 0);
+                _exit(b->run(ptr, STDIN_FILENO, STDOUT_FILENO));
+            }
+            environ = envp;
+            execvp(ptr->path_name, ptr->arguments);
+            perror(ptr->path_name);
+            _exit(EXIT_FAILURE);
+        }
+        else if(pgid != NULL){
+            // both sides set the group so neither can run ahead of it
+            setpgid(pid, *pgid == 0 ? pid : *pgid);
+        }
+    } else{
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+        short flags = POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETSIGMASK;
+        posix_spawnattr_setsigdefault(&attr, &default_signals);
+        posix_spawnattr_setsigmask(&attr, &empty_signals);
+        if(pgid != NULL){
+            flags |= POSIX_SPAWN_SETPGROUP;
+            posix_spawnattr_setpgroup(&attr, *pgid);
+#ifdef HAVE_SPAWN_TCSETPGRP
+            if(foreground && *pgid == 0){
+                posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+            }
+#endif
+        }
+        posix_spawnattr_setflags(&attr, flags);
+        if(in >= 0){posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);}
+        if(out >= 0){posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);}
+        int err = posix_spawn(&pid, ptr->path_name, &actions, &attr, ptr->arguments, envp);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if(err != 0){
+            if(err == ENOENT && ptr->type == bare){
+                // the remembered location went away, search again next time
+                exec_cache_forget(ptr->arguments[0]);
+            }
+            errno = err;
+            perror(ptr->path_name);
+            return -1;
+        }
+    }
+    if(pid > 0 && pgid != NULL && *pgid == 0){
+        *pgid = pid;
+        if(foreground){
+            tcsetpgrp(STDIN_FILENO, pid);
+        }
+    }
+    return pid;
+}
+
+// children start with the signal handling the shell had before it changed anything
+void reset_signals(void){
+    for(int sig = 1; sig < NSIG; sig++){
+        if(sigismember(&default_signals, sig) == 1){
+            signal(sig, SIG_DFL);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &empty_signals, NULL);
+}
+
+// how much of the kernel's argument space is left once the environment is in,
+// with the same headroom xargs keeps
+long arg_limit(void){
+    if(argLimit == 0){
+        long max = sysconf(_SC_ARG_MAX);
+        if(max <= 0){
+            max = 131072;
+        }
+        long env = sizeof(char *);
+        for(char** ptr = environ; *ptr != NULL; ptr++){
+            env += strlen(*ptr) + 1 + sizeof(char *);
+        }
+        argLimit = max - env - 2048;
+    }
+    return argLimit;
+}
+
+// bytes exec will need for arguments[start..end), the strings and their pointers
+long argument_bytes(process* ptr, int start, int end){
+    long total = sizeof(char *);
+    for(int i = start; i < end; i++){
+        total += strlen(ptr->arguments[i]) + 1 + sizeof(char *);
+    }
+    return total;
+}
+
+// with set -o xargs an expansion too large for one exec is run like xargs would:
+// a child of the shell runs the command once per batch of matches, one after another,
+// each time with the arguments written before and after the wildcard
+pid_t launch_split(process* ptr, int in, int out, pid_t* pgid, int foreground){
+    pid_t pid = fork();
+    if(pid != 0){
+        if(pid == -1){
+            perror("Error with fork");
+        } else if(pgid != NULL){
+            setpgid(pid, *pgid == 0 ? pid : *pgid);
+            if(*pgid == 0){
+                *pgid = pid;
+                if(foreground){
+                    tcsetpgrp(STDIN_FILENO, pid);
+                }
+            }
+        }
+        return pid;
+    }
+    if(pgid != NULL){
+        setpgid(0, *pgid);
+    }
+    reset_signals();
+    if(in >= 0){dup2(in, STDIN_FILENO);}
+    if(out >= 0){dup2(out, STDOUT_FILENO);}
+    long fixed = argument_bytes(ptr, 0, ptr->globStart) + argument_bytes(ptr, ptr->globEnd, ptr->argCount);
+    long room = arg_limit() - fixed;
+    process batch = *ptr;
+    batch.arguments = malloc(sizeof(char *) * (ptr->argCount + 1));
+    memcpy(batch.arguments, ptr->arguments, sizeof(char *) * ptr->globStart);
+    int status = 0;
+    int next = ptr->globStart;
+    while(next < ptr->globEnd){
+        int count = ptr->globStart;
+        long used = 0;
+        // always take at least one match so an oversized one still gets its error from exec
+        do{
+            used += strlen(ptr->arguments[next]) + 1 + sizeof(char *);
+            batch.arguments[count++] = ptr->arguments[next++];
+        } while(next < ptr->globEnd && used + (long) (strlen(ptr->arguments[next]) + 1 + sizeof(char *)) <= room);
+        for(int i = ptr->globEnd; i < ptr->argCount; i++){
+            batch.arguments[count++] = ptr->arguments[i];
+        }
+        batch.arguments[count] = NULL;
+        batch.argCount = count;
+        int child_status;
+        pid_t child = launch_process(&batch, -1, -1, NULL, 0);
+        if(child == -1 || waitpid(child, &child_status, 0) == -1
+            || !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0){
+            status = 1;
+        }
+    }
+    _exit(status);
+}
+
+// every stage is started before any of them is waited on, so data flows
+// through the whole pipeline at once instead of piling up in one pipe
+// a background pipeline becomes a job and is left running
+// when timing, each stage's start, end and resource usage are kept and reported
+int execute_processes(process* head, int background, int timing){
+    int status = 0;
+    int stages = 0;
+    process *ptr;
+    for(ptr = head; ptr != NULL; ptr = ptr->next){
+        stages++;
+    }
+    pid_t* pids = arena_alloc(&line_arena, sizeof(pid_t) * stages);
+    int* results = arena_alloc(&line_arena, sizeof(int) * stages);
+    int p[2];
+    int fdd = -1;
+    int stage = 0;
+    pid_t pgid = 0;
+    pid_t* group = job_control ? &pgid : NULL;
+    builtin_info* b;
+    process* deferred = NULL;
+    int deferred_in = -1;
+    int deferred_out = -1;
+    stage_time* times = NULL;
+    struct rusage self;
+    if(timing != TIME_NONE && !background){
+        times = arena_alloc(&line_arena, sizeof(stage_time) * stages);
+        memset(times, 0, sizeof(stage_time) * stages);
+    }
+    for(ptr = head; ptr != NULL; ptr = ptr->next, stage++){
+        int in = -1;
+        int out = -1;
+        pids[stage] = -1;
+        results[stage] = 0;
+        if(times != NULL){
+            clock_gettime(CLOCK_MONOTONIC, &times[stage].start);
+            getrusage(RUSAGE_SELF, &self);
+        }
+        p[0] = -1;
+        p[1] = -1;
+        long long start = trace_start();
+        if(ptr->next != NULL && pipe2(p, O_CLOEXEC) == -1){
+            perror("Error with pipe");
+            results[stage] = 1;
+            stages = stage + 1;
+            break;
+        }
+        if(ptr->next != NULL){
+            trace_end(PHASE_PIPE, start);
+        }
+        switch(ptr->type){
+            case cd:
+                results[stage] = run_cd(ptr);
+                break;
+            case pwd:
+            case set:
+            case hash:
+            case jobctl:
+            case builtin:
+                b = find_builtin(ptr->arguments[0], strlen(ptr->arguments[0]));
+                if(ptr->input != NULL){
+                    in = open(ptr->input, O_RDONLY|O_CLOEXEC);
+                    if(in < 0){
+                        perror(ptr->input);
+                        results[stage] = 1;
+                        break;
                     }
-                } else if(ptr->type == out){
-                    ptr = ptr->next;
-                    if(ptr != NULL){
-                        if(ptr->type == in || ptr->type == out || ptr->type == comb){
-                            free_command(command);
-                            errno = 1;
-                            perror("Double Special Character Error");
-                            return NULL;
-                        } else if(ptr->wildcard == 1){
-                            free_command(command);
-                            errno = 1;
-                            perror("Output can't be redirected to a wildcard");
-                            return NULL;
-                        } else if(command->output == NULL){
-                            command->output = malloc(sizeof(char) * (strlen(ptr->chrPtr) + 1));
-                            strcpy(command->output, ptr->chrPtr);
-                        } else{
-                            errno = 1;
-                            perror("Attempting Multiple Output Redirections");
-                            free_command(command);
-                            return NULL;
-                        }
-                    } else{
-                        errno = 5;
-                        perror("No Output Redirection Given");
-                        free_command(command);
-                        return NULL;
+                } else if(ptr->here != NULL && (in = here_input(ptr)) < 0){
+                    results[stage] = 1;
+                    break;
+                }
+                if(!builtin_in_shell(ptr, b, background, deferred != NULL)){
+                    pids[stage] = launch_process(ptr, in >= 0 ? in : fdd, p[1], group, !background);
+                    if(pids[stage] == -1){
+                        results[stage] = 1;
                     }
-                } else if(ptr->type == comb){
-                    if(ptr->next == NULL){
-                        errno = 1;
-                        perror("No Command Given");
-                        free_command(command);
-                        return NULL;
+                    break;
+                }
+                out = builtin_output(ptr, p[1]);
+                if(out < 0){
+                    results[stage] = 1;
+                    break;
+                }
+                if(b->streams && out == p[1]){
+                    // the first stage writes into a pipe nobody reads yet, so it waits for the rest
+                    deferred = ptr;
+                    deferred_in = in;
+                    deferred_out = out;
+                    in = -1;
+                    p[1] = -1;
+                    out = -1;
+                    break;
+                }
+                results[stage] = b->run(ptr, in >= 0 ? in : fdd >= 0 ? fdd : STDIN_FILENO, out);
+                if(out == p[1] || out == STDOUT_FILENO){
+                    out = -1;
+                }
+                break;
+            case path:
+            case bare:
+                if(ptr->input != NULL){
+                    in = open(ptr->input, O_RDONLY|O_CLOEXEC);
+                    if(in < 0){
+                        perror(ptr->input);
+                        results[stage] = 1;
+                        break;
+                    }
+                } else if(ptr->here != NULL){
+                    in = here_input(ptr);
+                    if(in < 0){
+                        results[stage] = 1;
+                        break;
+                    }
+                } else if(background && !job_control && ptr->prev == NULL){
+                    // without job control a background job must not fight the shell for its input
+                    in = open("/dev/null", O_RDONLY|O_CLOEXEC);
+                }
+                if(ptr->output != NULL){
+                    out = open(ptr->output, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0640);
+                    if(out < 0){
+                        perror(ptr->output);
+                        results[stage] = 1;
+                        break;
                     }
-                    command->next = process_tokens(ptr->next);
-                    if(command->next == NULL){
-                        free_command(command);
-                        return NULL;
-                    } else{
-                        command->next->prev = command;
-                        command->arguments = realloc(command->arguments, sizeof(char *) * (command->argCount + 1));
-                        command->arguments[command->argCount] = NULL;
-                        return command;
+                }
+                if(argument_bytes(ptr, 0, ptr->argCount) > arg_limit()){
+                    // batches repeat only what is outside the span, so a word inside it
+                    // that no wildcard produced would be run just once
+                    if(!xargs || ptr->globStart < 0 || ptr->globGap){
+                        errno = E2BIG;
+                        perror(ptr->path_name);
+                        results[stage] = 1;
+                        break;
                     }
+                    start = trace_start();
+                    pids[stage] = launch_split(ptr, in >= 0 ? in : fdd, out >= 0 ? out : p[1], group, !background);
                 } else{
-                    if(ptr->wildcard == 1){
-                        find_wildcards(command, ptr->chrPtr, ptr->type);
-                    } else{
-                        command->argCount++;
-                        command->arguments = realloc(command->arguments, sizeof(char *) * (command->argCount));
-                        command->arguments[command->argCount-1] = (char *) malloc(sizeof(char) * (strlen(ptr->chrPtr) + 1));
-                        memcpy(command->arguments[command->argCount-1], ptr->chrPtr, strlen(ptr->chrPtr));
-                        command->arguments[command->argCount-1][strlen(ptr->chrPtr)] = '\0';
+                    start = trace_start();
+                    pids[stage] = launch_process(ptr, in >= 0 ? in : fdd, out >= 0 ? out : p[1], group, !background);
+                }
+                trace_end(PHASE_SPAWN, start);
+                if(pids[stage] == -1){
+                    results[stage] = 1;
+                }
+                break;
+            case term:
+                status = 2;
+                break;
+            case assign:
+                // in a pipeline the assignment would belong to a subshell, so it does nothing
+                if(ptr->prev == NULL && ptr->next == NULL && !background){
+                    for(int i = 0; i < ptr->argCount; i++){
+                        set_var(ptr->arguments[i], 0);
                     }
                 }
+                break;
+            default:
+                break;
+        }
+        if(times != NULL && pids[stage] == -1){
+            // builtins ran in the shell, so what the shell used meanwhile is theirs
+            clock_gettime(CLOCK_MONOTONIC, &times[stage].end);
+            getrusage(RUSAGE_SELF, &times[stage].usage);
+            rusage_since(&times[stage].usage, &self);
+        }
+        if(in >= 0){close(in);}
+        if(out >= 0){close(out);}
+        // the write end now belongs to this stage and the read end to the next one
+        if(fdd >= 0){close(fdd);}
+        if(p[1] >= 0){close(p[1]);}
+        fdd = p[0];
+    }
+    if(fdd >= 0){close(fdd);}
+    if(deferred != NULL){
+        if(times != NULL){
+            getrusage(RUSAGE_SELF, &self);
+        }
+        b = find_builtin(deferred->arguments[0], strlen(deferred->arguments[0]));
+        results[0] = b->run(deferred, deferred_in >= 0 ? deferred_in : STDIN_FILENO, deferred_out);
+        if(deferred_in >= 0){close(deferred_in);}
+        close(deferred_out);
+        if(times != NULL){
+            clock_gettime(CLOCK_MONOTONIC, &times[0].end);
+            getrusage(RUSAGE_SELF, &times[0].usage);
+            rusage_since(&times[0].usage, &self);
+        }
+    }
+
+    if(background){
+        job* j = add_job(head, pids, results, stages, pgid);
+        if(interactive_shell){
+            fprintf(stderr, "[%d] %d\n", j->id, (int) j->pgid);
+        }
+        return status;
+    }
+    int stopped;
+    long long start = trace_start();
+    if(times != NULL){
+        stopped = wait_timed(pids, results, stages, job_control ? WUNTRACED : 0, times);
+    } else{
+        stopped = wait_stages(pids, results, stages, job_control ? WUNTRACED : 0, NULL);
+    }
+    trace_end(PHASE_WAIT, start);
+    if(job_control){
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+    if(stopped > 0){
+        // ctrl-z: whatever is left becomes a stopped job
+        job* j = add_job(head, pids, results, stages, pgid);
+        j->stopped = 1;
+        fprintf(stderr, "\n[%d]+  Stopped\t\t%s\n", j->id, j->text);
+        return 1;
+    }
+    if(status != 2){
+        status = pipeline_status(results, stages);
+    }
+    if(times != NULL){
+        report_timing(head, times, results, stages, timing);
+    }
+    return status;
+}
+
+// like wait_stages, but each stage is reaped the moment it exits, through a pidfd
+// per stage, so its end time is its own and not that of a stage waited on before it
+int wait_timed(pid_t* pids, int* results, int stages, int options, stage_time* times){
+    struct pollfd* fds = arena_alloc(&line_arena, sizeof(struct pollfd) * stages);
+    // a stage that stops keeps its pid but is done as far as this wait goes
+    char* waiting = arena_alloc(&line_arena, stages);
+    int pending = 0;
+    int stopped = 0;
+    for(int stage = 0; stage < stages; stage++){
+        fds[stage].fd = -1;
+        fds[stage].events = POLLIN;
+        waiting[stage] = pids[stage] != -1;
+        if(pids[stage] != -1){
+            fds[stage].fd = syscall(SYS_pidfd_open, pids[stage], 0);
+            pending++;
+        }
+    }
+    while(pending > 0){
+        // with job control a stage can stop instead of exiting, which a pidfd doesn't show
+        int ready = poll(fds, stages, options & WUNTRACED ? 100 : -1);
+        if(ready == -1 && errno != EINTR){
+            break;
+        }
+        for(int stage = 0; stage < stages; stage++){
+            if(!waiting[stage]){
+                continue;
+            }
+            int flags = fds[stage].fd == -1 ? options : WNOHANG|options;
+            if(fds[stage].fd != -1 && !(fds[stage].revents & POLLIN) && !(options & WUNTRACED)){
+                continue;
+            }
+            int child_status;
+            pid_t pid = wait4(pids[stage], &child_status, flags, &times[stage].usage);
+            if(pid == 0){
+                continue;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &times[stage].end);
+            if(pid == -1){
+                perror("Error with wait");
+                results[stage] = 1;
+            } else if(WIFSTOPPED(child_status)){
+                stopped++;
+            } else{
+                results[stage] = !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0;
+            }
+            if(pid == -1 || !WIFSTOPPED(child_status)){
+                pids[stage] = -1;
+            }
+            if(fds[stage].fd != -1){
+                close(fds[stage].fd);
+                fds[stage].fd = -1;
+            }
+            waiting[stage] = 0;
+            pending--;
+        }
+    }
+    return stopped;
+}
+
+// turns a getrusage total into what was used since before
+void rusage_since(struct rusage* now, struct rusage* before){
+    now->ru_utime.tv_sec -= before->ru_utime.tv_sec;
+    now->ru_utime.tv_usec -= before->ru_utime.tv_usec;
+    if(now->ru_utime.tv_usec < 0){
+        now->ru_utime.tv_sec--;
+        now->ru_utime.tv_usec += 1000000;
+    }
+    now->ru_stime.tv_sec -= before->ru_stime.tv_sec;
+    now->ru_stime.tv_usec -= before->ru_stime.tv_usec;
+    if(now->ru_stime.tv_usec < 0){
+        now->ru_stime.tv_sec--;
+        now->ru_stime.tv_usec += 1000000;
+    }
+    now->ru_nvcsw -= before->ru_nvcsw;
+    now->ru_nivcsw -= before->ru_nivcsw;
+}
+
+double elapsed(struct timespec* start, struct timespec* end){
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double seconds(struct timeval* tv){
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// prints a string as a JSON string literal
+void json_string(FILE* out, const char* str){
+    fputc('"', out);
+    for(; *str != '\0'; str++){
+        unsigned char c = *str;
+        if(c == '"' || c == '\\'){
+            fprintf(out, "\\%c", c);
+        } else if(c < 0x20){
+            fprintf(out, "\\u%04x", c);
+        } else{
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// time's report goes to stderr: a table with a row per stage and one for the whole
+// pipeline, POSIX's three lines with -p, or a single JSON object with -j
+void report_timing(process* head, stage_time* times, int* results, int stages, int format){
+    struct timespec start = times[0].start;
+    struct timespec end = times[0].end;
+    double user = 0, sys = 0;
+    long maxrss = 0, nvcsw = 0, nivcsw = 0;
+    for(int stage = 0; stage < stages; stage++){
+        if(elapsed(&end, &times[stage].end) > 0){
+            end = times[stage].end;
+        }
+        user += seconds(&times[stage].usage.ru_utime);
+        sys += seconds(&times[stage].usage.ru_stime);
+        if(times[stage].usage.ru_maxrss > maxrss){
+            maxrss = times[stage].usage.ru_maxrss;
+        }
+        nvcsw += times[stage].usage.ru_nvcsw;
+        nivcsw += times[stage].usage.ru_nivcsw;
+    }
+    double real = elapsed(&start, &end);
+    if(format == TIME_POSIX){
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n", real, user, sys);
+        return;
+    }
+    process* ptr = head;
+    if(format == TIME_JSON){
+        fprintf(stderr, "{\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,\"vcsw\":%ld,\"ivcsw\":%ld,\"stages\":[",
+            real, user, sys, maxrss, nvcsw, nivcsw);
+        for(int stage = 0; stage < stages; stage++, ptr = ptr->next){
+            struct rusage* ru = &times[stage].usage;
+            fprintf(stderr, "%s{\"command\":", stage > 0 ? "," : "");
+            json_string(stderr, ptr->arguments[0]);
+            fprintf(stderr, ",\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,\"vcsw\":%ld,\"ivcsw\":%ld,\"status\":%d}",
+                elapsed(&times[stage].start, &times[stage].end), seconds(&ru->ru_utime), seconds(&ru->ru_stime),
+                ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, results[stage]);
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+    fprintf(stderr, "%10s %10s %10s %10s %7s %7s  %s\n", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "command");
+    for(int stage = 0; stage < stages; stage++, ptr = ptr->next){
+        struct rusage* ru = &times[stage].usage;
+        fprintf(stderr, "%9.3fs %9.3fs %9.3fs %8ldkB %7ld %7ld  %s\n",
+            elapsed(&times[stage].start, &times[stage].end), seconds(&ru->ru_utime), seconds(&ru->ru_stime),
+            ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, ptr->arguments[0]);
+    }
+    if(stages > 1){
+        fprintf(stderr, "%9.3fs %9.3fs %9.3fs %8ldkB %7ld %7ld  %s\n", real, user, sys, maxrss, nvcsw, nivcsw, "(pipeline)");
+    }
+}
+
+// cuts the token list at ;, &, && and || into a list of pipelines
+// each pipeline keeps its own tokens and is only expanded if it gets to run
+list* parse_list(token* head){
+    token* ptr = head;
+    list* commands = head->type == body ? NULL : parse_commands(&ptr, 0);
+    if(ptr != NULL && ptr->type == body){
+        errno = EINVAL;
+        perror("do or done outside a loop");
+        return NULL;
+    }
+    return commands;
+}
+
+// parses up to the end of the tokens or the do or done that ends part of a loop,
+// which is left in *cursor; inside a loop empty commands left by newlines are skipped
+list* parse_commands(token** cursor, int nested){
+    list* first = NULL;
+    list* last = NULL;
+    token* ptr = *cursor;
+    while(ptr != NULL && ptr->type != body){
+        if(nested && ptr->type == semi){
+            ptr = ptr->next;
+            continue;
+        }
+        if(is_separator(ptr)){
+            errno = EINVAL;
+            perror("No Command Given");
+            return NULL;
+        }
+        list* node = arena_alloc(&line_arena, sizeof(list));
+        node->pipeline = ptr;
+        node->loop = NULL;
+        node->connector = semi;
+        node->next = NULL;
+        if(last == NULL){
+            first = node;
+        } else{
+            last->next = node;
+        }
+        last = node;
+        if(ptr->type == loop){
+            node->loop = parse_loop(&ptr);
+            if(node->loop == NULL){
+                return NULL;
+            }
+            if(ptr != NULL && ptr->type != semi && ptr->type != andif && ptr->type != orif && ptr->type != body){
+                errno = EINVAL;
+                perror("A loop can't be piped, redirected or put in the background");
+                return NULL;
+            }
+        } else{
+            while(ptr != NULL && !is_separator(ptr) && ptr->type != body){
+                ptr = ptr->next;
+            }
+        }
+        if(ptr != NULL && ptr->type != body){
+            node->connector = ptr->type;
+            ptr->prev->next = NULL;
+            ptr = ptr->next;
+            if(ptr != NULL){
+                ptr->prev = NULL;
+            }
+            if((ptr == NULL || ptr->type == body) && (node->connector == andif || node->connector == orif)){
+                errno = EINVAL;
+                perror("No Command Given");
+                return NULL;
+            }
+        } else if(ptr != NULL){
+            ptr->prev->next = NULL;
+        }
+    }
+    *cursor = ptr;
+    if(first == NULL){
+        errno = EINVAL;
+        perror("No Command Given");
+    }
+    return first;
+}
+
+// the header, condition and body are all parsed here, once, however many times
+// the loop goes round; *cursor is left after the done
+shell_loop* parse_loop(token** cursor){
+    token* ptr = *cursor;
+    shell_loop* l = arena_alloc(&line_arena, sizeof(shell_loop));
+    l->name = NULL;
+    l->words = NULL;
+    l->condition = NULL;
+    if(ptr->chrPtr[0] == 'f'){
+        token* name = ptr->next;
+        if(name == NULL || var_name_length(name->chrPtr, name->len) != name->len
+            || name->next == NULL || !token_is(name->next, "in")){
+            errno = EINVAL;
+            perror("for needs a name and in");
+            return NULL;
+        }
+        l->name = name;
+        ptr = name->next->next;
+        if(ptr != NULL && !is_separator(ptr)){
+            l->words = ptr;
+            ptr->prev = NULL;
+            while(ptr->next != NULL && !is_separator(ptr->next)){
                 ptr = ptr->next;
             }
-            command->arguments = realloc(command->arguments, sizeof(char *) * (command->argCount + 1));
-            command->arguments[command->argCount] = NULL;
-            return command;
-            break;
-        case in:
-        case out:
-        case comb:
-            free(command);
-            errno = 1;
-            perror("Command can't start with special character");
-            return NULL;
-            break;
+            token* end = ptr;
+            ptr = ptr->next;
+            end->next = NULL;
+        }
+        if(ptr == NULL || ptr->type != semi){
+            errno = EINVAL;
+            perror("for needs ; or a newline before do");
+            return NULL;
+        }
+        while(ptr != NULL && ptr->type == semi){
+            ptr = ptr->next;
+        }
+    } else{
+        ptr = ptr->next;
+        l->condition = parse_commands(&ptr, 1);
+        if(l->condition == NULL){
+            return NULL;
+        }
+    }
+    if(ptr == NULL || !token_is(ptr, "do")){
+        errno = EINVAL;
+        perror("Loop without do");
+        return NULL;
+    }
+    ptr = ptr->next;
+    l->body = parse_commands(&ptr, 1);
+    if(l->body == NULL){
+        return NULL;
+    }
+    if(ptr == NULL || !token_is(ptr, "done")){
+        errno = EINVAL;
+        perror("Loop without done");
+        return NULL;
+    }
+    *cursor = ptr->next;
+    return l;
+}
+
+int is_separator(token* tok){
+    return tok->type == semi || tok->type == amp || tok->type == andif || tok->type == orif;
+}
+
+// whether the word after this one is in command position, given whether this one is;
+// time, assignments, while and do leave the next word a command
+int command_follows(token* ptr, int command){
+    return is_separator(ptr) || ptr->type == comb || (command && (ptr->type == timed
+        || ptr->type == assign || ptr->type == body || (ptr->type == loop && ptr->chrPtr[0] == 'w')));
+}
+
+// runs the pipelines in order; && only goes on after a success and || only after a failure,
+// and a pipeline that is skipped never gets expanded or looked up
+int run_list(list* commands, int status){
+    int run = 1;
+    for(list* node = commands; node != NULL; node = node->next){
+        last_status = status;
+        if(run && node->loop != NULL){
+            status = run_loop(node->loop, status);
+            if(status == 2){
+                return status;
+            }
+        } else if(run){
+            // time in front of a pipeline reports what each of its stages cost
+            token* tokens = node->pipeline;
+            int timing = TIME_NONE;
+            if(tokens->type == timed){
+                timing = TIME_HUMAN;
+                tokens = tokens->next;
+                while(tokens != NULL && (token_is(tokens, "-p") || token_is(tokens, "-j"))){
+                    timing = tokens->chrPtr[1] == 'p' ? TIME_POSIX : TIME_JSON;
+                    tokens = tokens->next;
+                }
+            }
+            long long start = trace_start();
+            process* pipeline = NULL;
+            if(tokens != NULL){
+                run_substitutions(tokens);
+                pipeline = process_tokens(tokens);
+            }
+            trace_end(PHASE_PARSE, start);
+            if(tokens == NULL){
+                status = 0;
+            } else if(pipeline == NULL){
+                status = 1;
+            } else if((status = check_executables(pipeline)) == 0){
+                status = execute_processes(pipeline, node->connector == amp, timing);
+            }
+            if(status == 2){
+                return status;
+            }
+        }
+        if(node->connector == andif){
+            run = status == 0;
+        } else if(node->connector == orif){
+            run = status != 0;
+        } else{
+            run = 1;
+        }
+    }
+    return status;
+}
+
+// an interactive shell ignores SIGINT, which would leave a loop of builtins
+// that never starts a child unstoppable; while a loop runs ^C is caught instead
+int run_loop(shell_loop* l, int status){
+    if(!job_control){
+        return loop_rounds(l, status);
+    }
+    struct sigaction old;
+    catch_interrupt(&old);
+    status = loop_rounds(l, status);
+    sigaction(SIGINT, &old, NULL);
+    return status;
+}
+
+// SIGINT sets interrupted until the old action is put back
+void catch_interrupt(struct sigaction* old){
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interrupt_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, old);
+}
+
+void interrupt_handler(int sig){
+    (void) sig;
+    interrupted = 1;
+}
+
+// the loop's tokens and lists were built once, so each time round only expands
+// its words again, and gives what that allocated back to the arena
+int loop_rounds(shell_loop* l, int status){
+    arena_mark mark;
+    if(l->name == NULL){
+        status = 0;
+        while(!interrupted){
+            arena_get_mark(&line_arena, &mark);
+            int result = run_list(l->condition, status);
+            arena_rewind(&line_arena, &mark);
+            if(result == 2){
+                return result;
+            } else if(result != 0 || interrupted){
+                break;
+            }
+            status = run_list(l->body, result);
+            arena_rewind(&line_arena, &mark);
+            if(status == 2){
+                return status;
+            }
+        }
+        return status;
+    }
+    // the words are expanded and globbed once, before the first time round
+    process words;
+    memset(&words, 0, sizeof(words));
+    words.globStart = -1;
+    words.globEnd = -1;
+    run_substitutions(l->words);
+    for(token* ptr = l->words; ptr != NULL; ptr = ptr->next){
+        add_words(&words, ptr);
+    }
+    int nameLen = l->name->len;
+    status = 0;
+    for(int i = 0; i < words.argCount && !interrupted; i++){
+        arena_get_mark(&line_arena, &mark);
+        int valueLen = strlen(words.arguments[i]);
+        char* entry = arena_alloc(&line_arena, nameLen + valueLen + 2);
+        memcpy(entry, l->name->chrPtr, nameLen);
+        entry[nameLen] = '=';
+        memcpy(entry + nameLen + 1, words.arguments[i], valueLen + 1);
+        set_var(entry, 0);
+        status = run_list(l->body, status);
+        arena_rewind(&line_arena, &mark);
+        if(status == 2){
+            return status;
+        }
+    }
+    return status;
+}
+
+// without pipefail only the last stage decides the status
+int pipeline_status(int* results, int stages){
+    int status = results[stages - 1];
+    if(pipefail){
+        for(int stage = 0; stage < stages; stage++){
+            if(results[stage] != 0){
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
+
+// waits on every stage still running, or just polls them with WNOHANG
+// finished stages get their pid cleared; returns how many stages reported stopping
+// and counts the ones that reported continuing in *continued
+int wait_stages(pid_t* pids, int* results, int stages, int options, int* continued){
+    int stopped = 0;
+    for(int stage = 0; stage < stages; stage++){
+        int child_status;
+        if(pids[stage] == -1){
+            continue;
+        }
+        pid_t pid = waitpid(pids[stage], &child_status, options);
+        if(pid == 0){
+            continue;
+        }
+        if(pid == -1){
+            perror("Error with wait");
+            results[stage] = 1;
+            pids[stage] = -1;
+        } else if(WIFSTOPPED(child_status)){
+            stopped++;
+        } else if(WIFCONTINUED(child_status)){
+            if(continued != NULL){
+                (*continued)++;
+            }
+        } else{
+            results[stage] = !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0;
+            if(WIFSIGNALED(child_status) && WTERMSIG(child_status) == SIGINT){
+                interrupted = 1;
+            }
+            pids[stage] = -1;
+        }
+    }
+    return stopped;
+}
+
+// SIGCHLD only raises a flag; the jobs are reaped between lines,
+// where waiting can't interfere with a foreground pipeline
+void child_handler(int sig){
+    (void) sig;
+    child_exited = 1;
+}
+
+// interactive shells put every pipeline in its own process group and hand it the terminal
+void init_job_control(int interactive){
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = child_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    sigemptyset(&empty_signals);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGCHLD);
+    // a builtin writing to a closed pipe gets EPIPE instead of taking the shell down
+    signal(SIGPIPE, SIG_IGN);
+    sigaddset(&default_signals, SIGPIPE);
+    interactive_shell = interactive;
+    if(!interactive || tcgetpgrp(STDIN_FILENO) == -1){
+        return;
+    }
+    // wait until we are in the foreground before taking over the terminal
+    while(tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())){
+        kill(-shell_pgid, SIGTTIN);
+    }
+    int ignored[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+    for(int i = 0; i < (int) (sizeof(ignored) / sizeof(ignored[0])); i++){
+        signal(ignored[i], SIG_IGN);
+        sigaddset(&default_signals, ignored[i]);
+    }
+    shell_pgid = getpid();
+    if(setpgid(0, shell_pgid) == -1 && errno != EPERM){
+        perror("Couldn't put the shell in its own process group");
+        return;
+    }
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    job_control = 1;
+}
+
+// the text the job was started with, for jobs and the notifications
+char* tokens_text(token* tok){
+    int len = 0;
+    for(token* ptr = tok; ptr != NULL; ptr = ptr->next){
+        len += ptr->len + 1;
+    }
+    char* text = malloc(len + 1);
+    len = 0;
+    for(token* ptr = tok; ptr != NULL; ptr = ptr->next){
+        if(len > 0){
+            text[len++] = ' ';
+        }
+        memcpy(text + len, ptr->chrPtr, ptr->len);
+        len += ptr->len;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+job* add_job(process* head, pid_t* pids, int* results, int stages, pid_t pgid){
+    job* j = malloc(sizeof(job));
+    j->id = 1;
+    for(job* ptr = job_list; ptr != NULL; ptr = ptr->next){
+        if(ptr->id >= j->id){
+            j->id = ptr->id + 1;
+        }
+    }
+    j->pgid = pgid;
+    j->stages = stages;
+    j->pids = malloc(sizeof(pid_t) * stages);
+    j->results = malloc(sizeof(int) * stages);
+    memcpy(j->pids, pids, sizeof(pid_t) * stages);
+    memcpy(j->results, results, sizeof(int) * stages);
+    if(j->pgid == 0){
+        for(int i = 0; i < stages; i++){
+            if(pids[i] != -1){
+                j->pgid = pids[i];
+            }
+        }
+    }
+    j->stopped = 0;
+    j->text = tokens_text(head->source);
+    j->next = job_list;
+    job_list = j;
+    return j;
+}
+
+void remove_job(job* j){
+    job** link = &job_list;
+    while(*link != j){
+        link = &(*link)->next;
+    }
+    *link = j->next;
+    free(j->pids);
+    free(j->results);
+    free(j->text);
+    free(j);
+}
+
+int job_done(job* j){
+    for(int i = 0; i < j->stages; i++){
+        if(j->pids[i] != -1){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// collects whatever background children have finished, called between lines
+void reap_jobs(int notify){
+    if(!child_exited){
+        return;
+    }
+    child_exited = 0;
+    job* ptr = job_list;
+    while(ptr != NULL){
+        job* next = ptr->next;
+        int continued = 0;
+        int stopped = wait_stages(ptr->pids, ptr->results, ptr->stages, WNOHANG|WUNTRACED|WCONTINUED, &continued);
+        if(job_done(ptr)){
+            if(notify){
+                fprintf(stderr, "[%d]+  %s\t\t%s\n", ptr->id,
+                    pipeline_status(ptr->results, ptr->stages) == 0 ? "Done" : "Exit", ptr->text);
+            }
+            remove_job(ptr);
+        } else if(stopped > 0){
+            ptr->stopped = 1;
+        } else if(continued > 0){
+            ptr->stopped = 0;
+        }
+        ptr = next;
+    }
+}
+
+// %n or n names a job, anything else is matched against the job's process ids
+// with nothing given the most recent job is used
+job* find_job(char* arg){
+    if(arg == NULL){
+        return job_list;
+    }
+    char* end;
+    long id = strtol(arg[0] == '%' ? arg + 1 : arg, &end, 10);
+    if(*end != '\0'){
+        return NULL;
+    }
+    for(job* ptr = job_list; ptr != NULL; ptr = ptr->next){
+        if(arg[0] == '%' || id < 100000){
+            if(ptr->id == id){
+                return ptr;
+            }
+        }
+        for(int i = 0; i < ptr->stages; i++){
+            if(ptr->pids[i] == id){
+                return ptr;
+            }
+        }
+    }
+    return NULL;
+}
+
+void continue_job(job* j){
+    if(job_control){
+        kill(-j->pgid, SIGCONT);
+    } else{
+        for(int i = 0; i < j->stages; i++){
+            if(j->pids[i] != -1){
+                kill(j->pids[i], SIGCONT);
+            }
+        }
+    }
+    j->stopped = 0;
+}
+
+// waits for a job in the foreground; returns its status, or 1 if it stopped again
+int foreground_job(job* j){
+    if(job_control){
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+    }
+    int stopped = wait_stages(j->pids, j->results, j->stages, job_control ? WUNTRACED : 0, NULL);
+    if(job_control){
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+    if(stopped > 0){
+        j->stopped = 1;
+        fprintf(stderr, "\n[%d]+  Stopped\t\t%s\n", j->id, j->text);
+        return 1;
+    }
+    int status = pipeline_status(j->results, j->stages);
+    remove_job(j);
+    return status;
+}
+
+// wait leaves the terminal with the shell and sleeps until a child changes state;
+// a job that is stopped or stops is left to the user, and ^C gives up waiting
+int wait_job(job* j){
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    struct sigaction oldInt;
+    if(job_control){
+        catch_interrupt(&oldInt);
+    }
+    int status = 1;
+    while(!interrupted){
+        int stopped = wait_stages(j->pids, j->results, j->stages, WNOHANG|WUNTRACED, NULL);
+        if(job_done(j)){
+            status = pipeline_status(j->results, j->stages);
+            remove_job(j);
+            break;
+        }
+        if(stopped > 0 || j->stopped){
+            j->stopped = 1;
+            break;
+        }
+        sigsuspend(&old);
+    }
+    if(job_control){
+        sigaction(SIGINT, &oldInt, NULL);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return status;
+}
+
+// jobs, fg, bg and wait
+int run_job_builtin(process* ptr, int in, int out){
+    char* name = ptr->arguments[0];
+    char* arg = ptr->argCount > 1 ? ptr->arguments[1] : NULL;
+    child_exited = 1;
+    reap_jobs(0);
+    if(strcmp(name, "jobs") == 0){
+        // oldest first, the way they were started
+        int count = 0;
+        for(job* j = job_list; j != NULL; j = j->next){
+            count++;
+        }
+        for(int i = count - 1; i >= 0; i--){
+            job* j = job_list;
+            for(int k = 0; k < i; k++){
+                j = j->next;
+            }
+            dprintf(out, "[%d]%c  %s\t\t%s\n", j->id, j == job_list ? '+' : ' ',
+                j->stopped ? "Stopped" : "Running", j->text);
+        }
+        return 0;
+    }
+    if(strcmp(name, "wait") == 0 && arg == NULL){
+        int status = 0;
+        job* j = job_list;
+        while(j != NULL && !interrupted){
+            job* next = j->next;
+            if(!j->stopped){
+                status = wait_job(j);
+            }
+            j = next;
+        }
+        return status;
     }
-    return NULL;
+    job* j = find_job(arg);
+    if(j == NULL){
+        errno = ESRCH;
+        perror(arg == NULL ? name : arg);
+        return 1;
+    }
+    if(strcmp(name, "wait") == 0){
+        return wait_job(j);
+    }
+    if(strcmp(name, "bg") == 0){
+        continue_job(j);
+        dprintf(out, "[%d]+ %s &\n", j->id, j->text);
+        return 0;
+    }
+    if(strcmp(name, "fg") == 0){
+        dprintf(out, "%s\n", j->text);
+        continue_job(j);
+    }
+    return foreground_job(j);
 }
 
-char* find_executable(char *chr){
-    struct stat *buf = malloc(sizeof(struct stat));
-    int strLength = strlen(chr);
-    char first[] = "/usr/local/sbin/";
-    char *temp = (char*) malloc(sizeof(char) * (strlen(first) + strLength + 1));
-    strcpy(temp, first);
-    strcat(temp, chr);
-    if(stat(temp, buf) == 0){
-        if(buf->st_mode && S_IXUSR){
-            free(buf);
-            return temp;
-        }
-        errno = 1;
-        perror("Found but not executable");
-        free(temp);
-        free(buf);
-        return NULL;
+// expands a wildcard argument, matching one path component at a time so only
+// the components that hold wildcards cost a directory read
+// if nothing matches the argument is passed along as it was written
+// literal is NULL or has a byte per byte of name, set where the byte can't be a wildcard
+void find_wildcards(process* proc, char* name, const char* literal){
+    int count = 0;
+    int start = proc->argCount;
+    int root = name[0] == '/';
+    char* rest = name + root;
+    // each component is compiled once here, not once per directory it is matched in;
+    // literal components get NULL
+    int numComps = 1;
+    for(char* c = rest; *c != '\0'; c++){
+        numComps += *c == '/';
+    }
+    glob_pattern** pats = arena_alloc(&line_arena, sizeof(glob_pattern *) * numComps);
+    char* comp = rest;
+    for(int i = 0; i < numComps; i++){
+        char* slash = strchr(comp, '/');
+        int compLen = slash == NULL ? (int) strlen(comp) : slash - comp;
+        const char* compLit = literal == NULL ? NULL : literal + (comp - name);
+        pats[i] = has_wildcard(comp, compLit, compLen) ? compile_glob(comp, compLit, compLen) : NULL;
+        if(slash != NULL){
+            comp = slash + 1;
+        }
     }
+    expand_components(proc, root ? "/" : "", root, rest, pats, &count);
+    if(count == 0){
+        add_argument(proc, name);
+        return;
+    }
+    // matches come out in directory order, sort them like every other shell does
+    qsort(proc->arguments + start, count, sizeof(char *), collate_c ? compare_bytes : compare_collate);
+    if(proc->globStart < 0){
+        proc->globStart = start;
+    } else if(proc->globEnd != start){
+        proc->globGap = 1;
+    }
+    proc->globEnd = proc->argCount;
+}
+
+int compare_bytes(const void* a, const void* b){
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+int compare_collate(const void* a, const void* b){
+    return strcoll(*(char * const *) a, *(char * const *) b);
+}
 
-    char second[] = "/usr/local/bin/";
-    temp = (char*) realloc(temp, sizeof(char) * (strlen(second) + strLength + 1));
-    strcpy(temp, second);
-    strcat(temp, chr);
-    if(stat(temp, buf) == 0){
-        if(buf->st_mode && S_IXUSR){
-            free(buf);
-            return temp;
+int has_wildcard(const char* str, const char* literal, int len){
+    for(int i = 0; i < len; i++){
+        if((str[i] == '*' || str[i] == '?' || str[i] == '[') && (literal == NULL || !literal[i])){
+            return 1;
         }
-        errno = 1;
-        perror("Found but not executable");
-        free(buf);
-        free(temp);
-        return NULL;
     }
+    return 0;
+}
 
-    char third[] = "/usr/sbin/";
-    temp = (char*) realloc(temp, sizeof(char) * (strlen(third) + strLength + 1));
-    strcpy(temp, third);
-    strcat(temp, chr);
-    if(stat(temp, buf) == 0){
-        if(buf->st_mode && S_IXUSR){
-            free(buf);
-            return temp;
+// like has_wildcard on a word as written, skipping the commands inside $(...)
+int word_has_wildcard(const char* str, int len){
+    int i = 0;
+    while(i < len){
+        if(str[i] == '$' && i + 1 < len && str[i + 1] == '('){
+            int end = substitution_end(str, i + 1, len);
+            if(end != -1){
+                i = end;
+                continue;
+            }
         }
-        errno = 1;
-        perror("Found but not executable");
-        free(buf);
-        free(temp);
-        return NULL;
+        if(str[i] == '*' || str[i] == '?' || str[i] == '['){
+            return 1;
+        }
+        i++;
     }
+    return 0;
+}
 
-    char fourth[] = "/usr/bin/";
-    temp = (char*) realloc(temp, sizeof(char) * (strlen(fourth) + strLength + 1));
-    strcpy(temp, fourth);
-    strcat(temp, chr);
-    if(stat(temp, buf) == 0){
-        if(buf->st_mode && S_IXUSR){
-            free(buf);
-            return temp;
+// path is what has been matched so far, ending in '/' unless it is empty
+// rest is the part of the pattern still to match and pats its compiled components
+void expand_components(process* proc, char* path, int pathLen, char* rest, glob_pattern** pats, int* count){
+    struct stat buf;
+    char* slash = strchr(rest, '/');
+    int compLen = slash == NULL ? (int) strlen(rest) : slash - rest;
+    char* after = slash == NULL ? NULL : slash + 1;
+
+    glob_pattern* pat = pats[0];
+    if(pat == NULL){
+        // literal components are taken as they are, without reading the directory
+        int newLen = pathLen + compLen + (after != NULL);
+        char* newPath = arena_alloc(&line_arena, newLen + 1);
+        memcpy(newPath, path, pathLen);
+        memcpy(newPath + pathLen, rest, compLen);
+        if(after != NULL){
+            newPath[newLen-1] = '/';
+            newPath[newLen] = '\0';
+            expand_components(proc, newPath, newLen, after, pats + 1, count);
+        } else{
+            newPath[newLen] = '\0';
+            if(lstat(newPath, &buf) == 0){
+                add_argument(proc, newPath);
+                (*count)++;
+            }
         }
-        errno = 1;
-        perror("Found but not executable");
-        free(buf);
-        free(temp);
-        return NULL;
+        return;
     }
 
-    char fifth[] = "/sbin/";
-    temp = (char*) realloc(temp, sizeof(char) * (strlen(fifth) + strLength + 1));
-    strcpy(temp, fifth);
-    strcat(temp, chr);
-    if(stat(temp, buf) == 0){
-        if(buf->st_mode && S_IXUSR){
-            free(buf);
-            return temp;
+    dir_listing* dir = list_directory(pathLen == 0 ? "." : path);
+    if(dir == NULL){
+        return;
+    }
+    // the listing is a cache slot that reading the subdirectories may reuse,
+    // so the matching ones are all copied out before going into any of them
+    char** subdirs = NULL;
+    int numSubdirs = 0;
+    for(int i = 0; i < dir->count; i++){
+        char* name = dir->names + dir->entries[i].offset;
+        int dlen = dir->entries[i].len;
+        if(!glob_match(pat, name, dlen)){
+            continue;
+        }
+        unsigned char type = dir->entries[i].type;
+        if(after != NULL && type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN){
+            continue;
+        }
+        int newLen = pathLen + dlen + (after != NULL);
+        char* newPath = arena_alloc(&line_arena, newLen + 1);
+        memcpy(newPath, path, pathLen);
+        memcpy(newPath + pathLen, name, dlen);
+        if(after != NULL){
+            newPath[newLen-1] = '/';
+            newPath[newLen] = '\0';
+            if(subdirs == NULL){
+                subdirs = arena_alloc(&line_arena, sizeof(char *) * dir->count);
+            }
+            subdirs[numSubdirs++] = newPath;
+        } else{
+            newPath[newLen] = '\0';
+            add_argument(proc, newPath);
+            (*count)++;
         }
-        errno = 1;
-        perror("Found but not executable");
-        free(buf);
-        free(temp);
-        return NULL;
     }
+    for(int i = 0; i < numSubdirs; i++){
+        expand_components(proc, subdirs[i], strlen(subdirs[i]), after, pats + 1, count);
+    }
+}
 
-    char sixth[] = "/bin/";
-    temp = (char*) realloc(temp, sizeof(char) * (strlen(sixth) + strLength + 1));
-    strcpy(temp, sixth);
-    strcat(temp, chr);
-    if(stat(temp, buf) == 0){
-        if(buf->st_mode && S_IXUSR){
-            free(buf);
-            return temp;
+// returns the entries of a directory, reading it only if it changed since the last time
+// listings are matched on device, inode and mtime, so a renamed directory still hits
+// and any change to the directory misses
+dir_listing* list_directory(char* path){
+    struct stat buf;
+    if(stat(path, &buf) == -1 || !S_ISDIR(buf.st_mode)){
+        return NULL;
+    }
+    dir_clock++;
+    dir_listing* slot = &dir_cache[0];
+    for(int i = 0; i < DIR_CACHE_SIZE; i++){
+        dir_listing* dir = &dir_cache[i];
+        if(dir->names != NULL && dir->dev == buf.st_dev && dir->ino == buf.st_ino){
+            if(!dir->racy && dir->mtime.tv_sec == buf.st_mtim.tv_sec && dir->mtime.tv_nsec == buf.st_mtim.tv_nsec){
+                dir->lastUse = dir_clock;
+                return dir;
+            }
+            slot = dir;
+            break;
         }
-        errno = 1;
-        perror("Found but not executable");
-        free(buf);
-        free(temp);
+        if(dir->lastUse < slot->lastUse){
+            slot = dir;
+        }
+    }
+    if(read_directory(slot, path) == -1){
         return NULL;
     }
-    perror("Not Found");
-    free(temp);
-    free(buf);
-    return NULL;
+    slot->dev = buf.st_dev;
+    slot->ino = buf.st_ino;
+    slot->mtime = buf.st_mtim;
+    slot->lastUse = dir_clock;
+    // an entry added in the same clock tick as the listing would leave the mtime alone,
+    // so a listing taken right after a change is read again next time
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long age = (now.tv_sec - buf.st_mtim.tv_sec) * 1000000000L + (now.tv_nsec - buf.st_mtim.tv_nsec);
+    slot->racy = age < DIR_RACY_NS;
+    return slot;
+}
 
+int read_directory(dir_listing* dir, char* path){
+    int fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd == -1){
+        return -1;
+    }
+    int result = read_directory_fd(dir, fd);
+    close(fd);
+    return result;
 }
 
-int check_executables(process* head){
-    process* ptr = head;
-    while(ptr != NULL){
-        if(ptr->prev != NULL && ptr->input != NULL){
-            errno = 1; 
-            perror("Multiple input directions");
-            return 1;
-        }
-        if(ptr->next != NULL && ptr->output != NULL){
-            errno = 1; 
-            perror("Multiple output directions");
-            return 1;
+// fills a listing with getdents64 straight into one large buffer
+// for callers that keep the directory open for fstatat
+int read_directory_fd(dir_listing* dir, int fd){
+    if(dents_buffer == NULL){
+        dents_buffer = malloc(DENTS_SIZE);
+    }
+    if(dir->names == NULL){
+        dir->namesCap = 4096;
+        dir->names = malloc(dir->namesCap);
+        dir->entryCap = 64;
+        dir->entries = malloc(sizeof(dir_entry) * dir->entryCap);
+    }
+    dir->count = 0;
+    int namesLen = 0;
+    long nread;
+    while((nread = getdents64(fd, dents_buffer, DENTS_SIZE)) > 0){
+        long pos = 0;
+        while(pos < nread){
+            struct dirent64* de = (struct dirent64 *) (dents_buffer + pos);
+            pos += de->d_reclen;
+            int dlen = strlen(de->d_name);
+            if(namesLen + dlen + 1 > dir->namesCap){
+                while(namesLen + dlen + 1 > dir->namesCap){
+                    dir->namesCap *= 2;
+                }
+                dir->names = realloc(dir->names, dir->namesCap);
+            }
+            if(dir->count == dir->entryCap){
+                dir->entryCap *= 2;
+                dir->entries = realloc(dir->entries, sizeof(dir_entry) * dir->entryCap);
+            }
+            memcpy(dir->names + namesLen, de->d_name, dlen + 1);
+            dir->entries[dir->count].offset = namesLen;
+            dir->entries[dir->count].len = dlen;
+            dir->entries[dir->count].type = de->d_type;
+            dir->count++;
+            namesLen += dlen + 1;
         }
-        ptr = ptr->next;
+    }
+    if(nread == -1){
+        // a cache slot must not keep claiming the directory it held before
+        dir->count = 0;
+        dir->dev = 0;
+        dir->ino = 0;
+        return -1;
     }
     return 0;
 }
 
-int execute_processes(process* head){
-    int status = 0;
-    process *ptr = head;
-    int p[2];
-    int fdd = -1;
-    while(ptr != NULL){
-        int in = -1;
-        int out = -1;
-        if(pipe(p) == -1){
-            perror("Error with pipe");
-            return 1;
+// adds a name to the command trie; siblings are kept in byte order so
+// candidates come out sorted
+void trie_insert(const char* name, int len){
+    int node = 0;
+    for(int i = 0; i < len; i++){
+        if(command_names.count == command_names.cap){
+            command_names.cap *= 2;
+            command_names.nodes = realloc(command_names.nodes, command_names.cap * sizeof(trie_node));
+            if(command_names.nodes == NULL){
+                perror("completion");
+                exit(EXIT_FAILURE);
+            }
         }
-        switch(ptr->type){
-            case cd:
-                if(ptr->argCount > 2){
-                    errno = 7; 
-                    perror("Error with cd");
-                }
-                else if (ptr->argCount < 2){
-                    if(chdir(getenv("HOME")) == -1){
-                        perror("Error with cd"); 
-                        return 1;
-                    }
-                }
-                else{
-                    if(chdir(ptr->arguments[1]) == -1){
-                        perror("Error with cd");
-                        return 1;
-                    }
-                }
-                if(ptr->prev != NULL){
-                    close(fdd);
-                }
-                if(ptr->next != NULL){
-                    fdd = p[0];
-                    close(p[1]);
-                }
-                break;
-            case pwd:;
-                char* buffer = getcwd(NULL, 0);
-                int len = strlen(buffer);
-                buffer = realloc(buffer, sizeof(char) * (len + 2));
-                if(ptr->prev != NULL){
-                    close(fdd);
-                }
-                if(buffer == NULL){
-                    perror("pwd: couldn't get current working directory");
-                    free(buffer);
-                    return 1;
-                }
-                else{
-                    buffer[len] = '\n';
-                    buffer[len+1] = '\0';
-                    if(ptr->output != NULL){
-                        out = open(ptr->output, O_CREAT|O_TRUNC|O_WRONLY, 0640);
-                        if(out < 0){
-                            perror("pwd: ");
-                            free(buffer);
-                            return 1;
-                        }
-                        else{
-                            write(out, buffer, strlen(buffer));
-                            close(out);
-                        }
-                    }
-                    else if(ptr->next != NULL){
-                        write(p[1], buffer, strlen(buffer));
-                        fdd = p[0];
-                        close(p[1]);
-                    }
-                    else{
-                        write(STDOUT_FILENO, buffer, strlen(buffer));
-                    }
-                }
-                free(buffer);
-                break;
-            case path:
-            case bare:;
-                int child_status;
-                if(ptr->input != NULL){
-                    in = open(ptr->input, O_RDONLY);
-                    if(in < 0){
-                        perror("Error with open");
-                        return 1;
-                    }
-                }
-                if(ptr->output != NULL){
-                    out = open(ptr->output, O_CREAT|O_TRUNC|O_WRONLY, 0640);
-                    if(out < 0){
-                        perror("Error with open");
-                        return 1;
-                    }
-                }
-                int pid = fork();
-                if(pid == -1){
-                    perror("Error with fork");
-                    return 1;
-                }
-                else if(pid == 0){
-                    if(in > 0){dup2(in, STDIN_FILENO);}
-                    if(out > 0){dup2(out, STDOUT_FILENO);}
-                    if(ptr->next != NULL){
-                        dup2(p[1], STDOUT_FILENO);
-                    }
-                    if(ptr->prev != NULL){
-                        dup2(fdd, STDIN_FILENO);
-                    }
-                    close(p[0]);
-                    execvp(ptr->path_name, ptr->arguments);
-                    perror(ptr->path_name);
-                    _exit(EXIT_FAILURE);
-                }
-                else{
-                    if(wait(&child_status) >= 0){
-                        if(WIFEXITED(child_status)){
-                            if(WEXITSTATUS(child_status) == EXIT_FAILURE){
-                                return 1;
-                            }
-                        }
-                    }
-                    else{
-                        perror(ptr->path_name);
-                        return 1;
-                    }
-                    close(p[1]);
-                    if(ptr->prev != NULL){close(fdd);}
-                    fdd = p[0];
-                }
-                break;
-            case term:
-                if(ptr->prev != NULL){
-                    close(fdd);
-                }
-                if(ptr->next != NULL){
-                    close(p[1]);
-                    fdd = p[0];
-                }
-                status = 2;
-                break;
-            default:
-                break;
+        unsigned char c = name[i];
+        int* link = &command_names.nodes[node].child;
+        while(*link != -1 && command_names.nodes[*link].chr < c){
+            link = &command_names.nodes[*link].sibling;
         }
-        if(in > 0){close(in);}
-        if(out > 0){close(out);}
-        ptr = ptr->next;
+        if(*link == -1 || command_names.nodes[*link].chr != c){
+            command_names.nodes[command_names.count] = (trie_node) {-1, *link, 0, c, 0};
+            *link = command_names.count++;
+        }
+        node = *link;
+    }
+    if(command_names.nodes[node].end){
+        // found in an earlier directory
+        return;
+    }
+    command_names.nodes[node].end = 1;
+    // count the name on every node down to it
+    node = 0;
+    command_names.nodes[0].names++;
+    for(int i = 0; i < len; i++){
+        node = command_names.nodes[node].child;
+        while(command_names.nodes[node].chr != (unsigned char) name[i]){
+            node = command_names.nodes[node].sibling;
+        }
+        command_names.nodes[node].names++;
     }
-    return status;
 }
 
-void find_wildcards(process* proc, char* name, int type){
-    struct dirent* de;
-    char* dir = malloc(sizeof(char) * 100);
-    char* pattern = malloc(sizeof(char) * 100);
-    int check_begin = 0;
+// the trie is built again when PATH is different or one of its directories changed
+int command_trie_stale(void){
+    exec_cache_sync();
+    if(command_names.path == NULL || strcmp(command_names.path, cached_path) != 0
+        || command_names.dirs != num_path_dirs){
+        return 1;
+    }
+    struct stat buf;
+    for(int i = 0; i < num_path_dirs; i++){
+        struct timespec mtime = {0, 0};
+        if(stat(path_dirs[i].name, &buf) == 0){
+            mtime = buf.st_mtim;
+        }
+        if(mtime.tv_sec != command_names.mtimes[i].tv_sec || mtime.tv_nsec != command_names.mtimes[i].tv_nsec){
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    if(type == path){
-        int index;
-        for(int i = 0; i < strlen(name); i++){
-            if(name[i] == '/'){
-                index = i;
+// every builtin and every executable in the PATH directories; a directory is
+// stamped with its mtime before it is read, so a change while reading shows next time
+void build_command_trie(void){
+    free(command_names.path);
+    free(command_names.mtimes);
+    command_names.path = strdup(cached_path);
+    command_names.dirs = num_path_dirs;
+    command_names.mtimes = calloc(num_path_dirs, sizeof(struct timespec));
+    if(command_names.nodes == NULL){
+        command_names.cap = 4096;
+        command_names.nodes = malloc(command_names.cap * sizeof(trie_node));
+    }
+    if(command_names.path == NULL || command_names.mtimes == NULL || command_names.nodes == NULL){
+        perror("completion");
+        exit(EXIT_FAILURE);
+    }
+    command_names.count = 1;
+    command_names.nodes[0] = (trie_node) {-1, -1, 0, 0, 0};
+    for(int i = 0; i < BUILTIN_SLOTS; i++){
+        if(builtin_table[i].name != NULL){
+            trie_insert(builtin_table[i].name, builtin_table[i].len);
+        }
+    }
+    dir_listing listing;
+    memset(&listing, 0, sizeof(listing));
+    struct stat buf;
+    for(int i = 0; i < num_path_dirs; i++){
+        // one descriptor for the mtime, the listing and the stat of every entry
+        int fd = open(path_dirs[i].name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if(fd == -1){
+            // an unreadable directory still gets its mtime, or the trie would always look stale
+            if(stat(path_dirs[i].name, &buf) == 0){
+                command_names.mtimes[i] = buf.st_mtim;
+            }
+            continue;
+        }
+        if(fstat(fd, &buf) == 0){
+            command_names.mtimes[i] = buf.st_mtim;
+        }
+        if(read_directory_fd(&listing, fd) == -1){
+            close(fd);
+            continue;
+        }
+        for(int j = 0; j < listing.count; j++){
+            char* name = listing.names + listing.entries[j].offset;
+            unsigned char type = listing.entries[j].type;
+            if(name[0] == '.' || (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)){
+                continue;
+            }
+            if(fstatat(fd, name, &buf, 0) == 0 && S_ISREG(buf.st_mode) && (buf.st_mode & (S_IXUSR|S_IXGRP|S_IXOTH))){
+                trie_insert(name, listing.entries[j].len);
             }
         }
-        dir = realloc(dir, sizeof(char) * (index + 1));
-        strncpy(dir, name, index);
-        dir[index] = '\0';
-        pattern = realloc(pattern, sizeof(char) * (strlen(name) - index));
-        strcpy(pattern, name + index + 1);
+        close(fd);
     }
-    else{
-        dir = realloc(dir, sizeof(char) * 3);
-        strcpy(dir, ".");
-        pattern = realloc(pattern, sizeof(char) * (strlen(name) + 1));
-        strcpy(pattern, name);
+    free(listing.names);
+    free(listing.entries);
+}
+
+// appends the names below a node, each ending in a NUL, until limit are out
+void trie_names(int node, byte_buffer* prefix, byte_buffer* out, int* limit){
+    if(*limit == 0){
+        return;
     }
-    if(pattern[0] == '*'){
-        check_begin = 1;
+    if(command_names.nodes[node].end){
+        buffer_add(out, prefix->data, prefix->len);
+        buffer_add(out, "", 1);
+        (*limit)--;
     }
-    DIR *dp = opendir(dir);
-    if(!dp){
-        perror("Error with opening directory");
-        return;
+    for(int child = command_names.nodes[node].child; child != -1 && *limit > 0; child = command_names.nodes[child].sibling){
+        char c = command_names.nodes[child].chr;
+        buffer_add(prefix, &c, 1);
+        trie_names(child, prefix, out, limit);
+        prefix->len--;
+    }
+}
+
+// the entries of the word's directory that start with the rest of the word,
+// with a slash after directories; list_directory keeps the listing for the next Tab
+int file_candidates(const char* word, int len, byte_buffer* out){
+    int slash = len;
+    while(slash > 0 && word[slash - 1] != '/'){
+        slash--;
     }
+    char* dirName = arena_strndup(&line_arena, slash == 0 ? "." : word, slash == 0 ? 1 : slash);
+    dir_listing* dir = list_directory(dirName);
+    if(dir == NULL){
+        return 0;
+    }
+    const char* part = word + slash;
+    int partLen = len - slash;
     int count = 0;
-    int dirLen = strlen(dir);
-    while((de = readdir(dp))){
-        if(check_wildcard(de->d_name, pattern) == 1){
-            if(check_begin == 1 && de->d_name[0] == '.'){
-                continue;
+    for(int i = 0; i < dir->count; i++){
+        char* name = dir->names + dir->entries[i].offset;
+        int nameLen = dir->entries[i].len;
+        if(nameLen < partLen || memcmp(name, part, partLen) != 0 || (name[0] == '.' && partLen == 0)
+            || strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+            continue;
+        }
+        unsigned char type = dir->entries[i].type;
+        struct stat buf;
+        if(type == DT_LNK || type == DT_UNKNOWN){
+            char* full = arena_alloc(&line_arena, slash + nameLen + 1);
+            memcpy(full, word, slash);
+            memcpy(full + slash, name, nameLen + 1);
+            type = stat(full, &buf) == 0 && S_ISDIR(buf.st_mode) ? DT_DIR : DT_REG;
+        }
+        buffer_add(out, name, nameLen);
+        buffer_add(out, type == DT_DIR ? "/" : "", type == DT_DIR ? 2 : 1);
+        count++;
+    }
+    return count;
+}
+
+// lays the candidates out in columns under the line being edited
+void show_candidates(byte_buffer* names, int count, int total){
+    struct winsize size;
+    int cols = ioctl(STDERR_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    int width = 0;
+    for(size_t pos = 0; pos < names->len; pos += strlen(names->data + pos) + 1){
+        int len = strlen(names->data + pos);
+        width = len > width ? len : width;
+    }
+    width += 2;
+    int perRow = cols / width > 0 ? cols / width : 1;
+    byte_buffer out = {0};
+    buffer_add(&out, "\n", 1);
+    int column = 0;
+    for(size_t pos = 0; pos < names->len; pos += strlen(names->data + pos) + 1){
+        int len = strlen(names->data + pos);
+        buffer_add(&out, names->data + pos, len);
+        if(++column == perRow){
+            buffer_add(&out, "\n", 1);
+            column = 0;
+        } else{
+            buffer_add(&out, "                                ", width - len < 32 ? width - len : 32);
+        }
+    }
+    if(column != 0){
+        buffer_add(&out, "\n", 1);
+    }
+    if(total > count){
+        char more[64];
+        buffer_add(&out, more, snprintf(more, sizeof(more), "... and %d more\n", total - count));
+    }
+    write_all(STDERR_FILENO, out.data, out.len);
+    free(out.data);
+}
+
+// Tab: the first word of a command completes from the trie of command names,
+// anything else from the directory it names; the word is extended as far as
+// every candidate agrees, and when that is nowhere the candidates are listed
+void complete_line(line_editor* ed){
+    int start = ed->pos;
+    while(start > 0 && char_class[(unsigned char) ed->buf[start - 1]] == 0){
+        start--;
+    }
+    int before = start;
+    while(before > 0 && char_class[(unsigned char) ed->buf[before - 1]] == CH_BLANK){
+        before--;
+    }
+    char* word = ed->buf + start;
+    int len = ed->pos - start;
+    int command = (before == 0 || strchr("|;&", ed->buf[before - 1]) != NULL) && memchr(word, '/', len) == NULL;
+    byte_buffer names = {0};
+    int count = 0, total = 0;
+    if(command){
+        if(command_trie_stale()){
+            build_command_trie();
+        }
+        int node = 0;
+        for(int i = 0; i < len && node != -1; i++){
+            node = command_names.nodes[node].child;
+            while(node != -1 && command_names.nodes[node].chr != (unsigned char) word[i]){
+                node = command_names.nodes[node].sibling;
             }
-            int dlen = strlen(de->d_name);
-            if(type == path){
-                proc->argCount++;
-                proc->arguments = realloc(proc->arguments, sizeof(char *) * (proc->argCount));
-                proc->arguments[proc->argCount - 1] = malloc(sizeof(char) * (dlen + dirLen + 2));
-                memcpy(proc->arguments[proc->argCount-1], dir, dirLen);
-                proc->arguments[proc->argCount-1][dirLen] = '/';
-                memcpy(proc->arguments[proc->argCount-1] + dirLen + 1, de->d_name,dlen);
-                proc->arguments[proc->argCount-1][dirLen + 1 + dlen] = '\0';
-                count++;
+        }
+        if(node == -1 || command_names.nodes[node].names == 0){
+            write_all(STDERR_FILENO, "\a", 1);
+            return;
+        }
+        // follow the trie while there is only one way to go
+        char extend[256];
+        int extendLen = 0;
+        while(!command_names.nodes[node].end && command_names.nodes[node].names == command_names.nodes[command_names.nodes[node].child].names
+            && extendLen < (int) sizeof(extend) - 1){
+            node = command_names.nodes[node].child;
+            extend[extendLen++] = command_names.nodes[node].chr;
+        }
+        // the space goes after a whole name, which a walk cut short by the buffer hasn't reached
+        if(command_names.nodes[node].names == 1 && command_names.nodes[node].end){
+            extend[extendLen++] = ' ';
+        }
+        if(extendLen > 0){
+            editor_insert(ed, extend, extendLen);
+            return;
+        }
+        byte_buffer prefix = {0};
+        buffer_add(&prefix, word, len);
+        int limit = COMPLETION_LIST;
+        trie_names(node, &prefix, &names, &limit);
+        free(prefix.data);
+        count = COMPLETION_LIST - limit;
+        total = command_names.nodes[node].names;
+    } else{
+        total = count = file_candidates(word, len, &names);
+        if(count == 0){
+            write_all(STDERR_FILENO, "\a", 1);
+            return;
+        }
+        int slash = len;
+        while(slash > 0 && word[slash - 1] != '/'){
+            slash--;
+        }
+        // how far every candidate agrees past what was typed
+        char* first = names.data;
+        int common = strlen(first);
+        for(size_t pos = 0; pos < names.len; pos += strlen(names.data + pos) + 1){
+            int i = 0;
+            while(i < common && names.data[pos + i] == first[i]){
+                i++;
             }
-            else if(type == bare){
-                proc->argCount++;
-                proc->arguments = realloc(proc->arguments, sizeof(char *) * (proc->argCount));
-                proc->arguments[proc->argCount - 1] = malloc(sizeof(char) * (dlen + 1));
-                memcpy(proc->arguments[proc->argCount-1], de->d_name, dlen);
-                proc->arguments[proc->argCount-1][dlen] = '\0';
-                count++;
+            common = i;
+        }
+        int typed = len - slash;
+        if(common > typed || count == 1){
+            char* rest = arena_strndup(&line_arena, first + typed, common - typed);
+            editor_insert(ed, rest, common - typed);
+            if(count == 1 && (common == 0 || first[common - 1] != '/')){
+                editor_insert(ed, " ", 1);
             }
+            free(names.data);
+            return;
         }
     }
-    if(count == 0){
-        proc->argCount++;
-        proc->arguments = realloc(proc->arguments, sizeof(char *) * (proc->argCount));
-        proc->arguments[proc->argCount - 1] = malloc(sizeof(char) * (strlen(name) + 1));
-        memcpy(proc->arguments[proc->argCount-1], name, strlen(name));
-        proc->arguments[proc->argCount-1][strlen(name)] = '\0';
-    }
-    closedir(dp);
-    free(dir);
-    free(pattern);
+    show_candidates(&names, count, total);
+    free(names.data);
 }
 
-int check_wildcard(char* file, char* pat){
-    int file_len = strlen(file);
-    int pat_len = strlen(pat);
-    int i = 0; int j = 0;
-    int index_file = -1; int index_pat = -1;
-    while(i < file_len){
-        if (j < pat_len && file[i] == pat[j])
-        {
+// turns one path component of a pattern into a list of elements: literal
+// characters, '?', bracket classes and '*'
+// an unterminated '[' is just a character, and so is any byte set in literal
+glob_pattern* compile_glob(const char* pat, const char* literal, int len){
+    glob_pattern* g = arena_alloc(&line_arena, sizeof(glob_pattern));
+    g->elems = arena_alloc(&line_arena, sizeof(glob_elem) * (len + 1));
+    g->count = 0;
+    g->minLen = 0;
+    g->stars = 0;
+    g->dotfiles = len > 0 && pat[0] == '.';
+    int i = 0;
+    while(i < len){
+        glob_elem* e = &g->elems[g->count];
+        char c = pat[i];
+        if(literal != NULL && literal[i]){
+            e->kind = GLOB_CHAR;
+            e->chr = c;
+            g->minLen++;
+            g->count++;
             i++;
-            j++;
+            continue;
         }
-        else if (j < pat_len && pat[j] == '*')
-        {
-            index_file = i;
-            index_pat = j;
-            j++;
+        if(c == '*'){
+            // runs of stars mean the same as one, so "**" never crosses a '/'
+            if(g->count == 0 || g->elems[g->count-1].kind != GLOB_STAR){
+                e->kind = GLOB_STAR;
+                g->count++;
+                g->stars++;
+            }
+            i++;
+            continue;
         }
-        else if (index_pat != -1)
-        {
-            j = index_pat + 1;
-            i = index_file + 1;
-            index_file++;
+        g->minLen++;
+        g->count++;
+        if(c == '?'){
+            e->kind = GLOB_ANY;
+            i++;
+            continue;
         }
-        else
-        {
-            return 0;
+        if(c == '['){
+            int end = i + 1;
+            if(end < len && (pat[end] == '!' || pat[end] == '^')){
+                end++;
+            }
+            // a ']' right after the opening bracket is part of the class
+            if(end < len && pat[end] == ']'){
+                end++;
+            }
+            while(end < len && (pat[end] != ']' || (literal != NULL && literal[end]))){
+                end++;
+            }
+            if(end < len){
+                int j = i + 1;
+                int negate = pat[j] == '!' || pat[j] == '^';
+                if(negate){
+                    j++;
+                }
+                e->kind = GLOB_SET;
+                e->set = arena_alloc(&line_arena, 32);
+                memset(e->set, 0, 32);
+                while(j < end){
+                    unsigned char lo = pat[j];
+                    unsigned char hi = lo;
+                    if(j + 2 < end && pat[j+1] == '-'){
+                        hi = pat[j+2];
+                        j += 3;
+                    } else{
+                        j++;
+                    }
+                    for(int b = lo; b <= hi; b++){
+                        e->set[b >> 3] |= 1 << (b & 7);
+                    }
+                }
+                if(negate){
+                    for(int b = 0; b < 32; b++){
+                        e->set[b] = ~e->set[b];
+                    }
+                }
+                i = end + 1;
+                continue;
+            }
         }
+        e->kind = GLOB_CHAR;
+        e->chr = c;
+        i++;
     }
-    while(j < pat_len && pat[j] == '*'){
-        j++;
+    // literal characters at either end let most names be rejected with one memcmp
+    g->prefix = arena_alloc(&line_arena, g->count + 1);
+    g->prefixLen = 0;
+    while(g->prefixLen < g->count && g->elems[g->prefixLen].kind == GLOB_CHAR){
+        g->prefix[g->prefixLen] = g->elems[g->prefixLen].chr;
+        g->prefixLen++;
     }
-    if(j == pat_len){
-        return 1;
+    g->suffixLen = 0;
+    if(g->stars > 0){
+        while(g->suffixLen < g->count && g->elems[g->count - 1 - g->suffixLen].kind == GLOB_CHAR){
+            g->suffixLen++;
+        }
     }
-    return 0;
+    g->suffix = arena_alloc(&line_arena, g->suffixLen + 1);
+    for(int j = 0; j < g->suffixLen; j++){
+        g->suffix[j] = g->elems[g->count - g->suffixLen + j].chr;
+    }
+    return g;
+}
+
+// matches n elements without stars against name[0..n)
+int glob_segment(glob_elem* e, int n, const char* name){
+    for(int i = 0; i < n; i++){
+        unsigned char c = name[i];
+        if(e[i].kind == GLOB_CHAR){
+            if(c != e[i].chr){
+                return 0;
+            }
+        } else if(e[i].kind == GLOB_SET){
+            if(!(e[i].set[c >> 3] & (1 << (c & 7)))){
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// the pieces between stars are placed leftmost-first without ever backing up,
+// which finds a match whenever one exists; each piece may be tried at every
+// position, so the worst case is the name's length times the pattern's
+int glob_match(glob_pattern* g, const char* name, int len){
+    if(len < g->minLen){
+        return 0;
+    }
+    if(name[0] == '.' && (!g->dotfiles || len == 1 || (len == 2 && name[1] == '.'))){
+        return 0;
+    }
+    if(memcmp(name, g->prefix, g->prefixLen) != 0){
+        return 0;
+    }
+    if(memcmp(name + len - g->suffixLen, g->suffix, g->suffixLen) != 0){
+        return 0;
+    }
+    if(g->stars == 0){
+        return len == g->count && glob_segment(g->elems, g->count, name);
+    }
+    int first = 0;
+    while(g->elems[first].kind != GLOB_STAR){
+        first++;
+    }
+    int last = g->count;
+    while(g->elems[last-1].kind != GLOB_STAR){
+        last--;
+    }
+    int lastLen = g->count - last;
+    int limit = len - lastLen;
+    if(!glob_segment(g->elems, first, name) || !glob_segment(g->elems + last, lastLen, name + limit)){
+        return 0;
+    }
+    int pos = first;
+    int i = first + 1;
+    while(i < last){
+        int end = i;
+        while(g->elems[end].kind != GLOB_STAR){
+            end++;
+        }
+        int segLen = end - i;
+        while(pos + segLen <= limit && !glob_segment(g->elems + i, segLen, name + pos)){
+            pos++;
+        }
+        if(pos + segLen > limit){
+            return 0;
+        }
+        pos += segLen;
+        i = end + 1;
+    }
+    return pos <= limit;
+}
+
+int check_wildcard(char* file, char* pat){
+    return glob_match(compile_glob(pat, NULL, strlen(pat)), file, strlen(file));
 }